@@ -0,0 +1,852 @@
+/*
+  ==============================================================================
+
+    Benchmarks for the expression engine and the processing pipeline.
+    Prints one JSON document, so results can be diffed between releases.
+
+    Every number is the median over a fixed number of runs, on fixed input
+    (seeded noise, fixed dither seed), so two runs on the same machine
+    measure exactly the same work.
+
+    The checks compare backends that have to give identical results and
+    make the run exit with 2 if they don't.
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+#include "../../Source/PluginProcessor.h"
+#include "../../Source/ExprCompiler.h"
+#include "../../Source/ExprOptimizer.h"
+#include "../../Source/ExprCache.h"
+#include "../../Source/ExprJit.h"
+#include "../../Source/ExprAnalysis.h"
+#include "../../Source/CrusherKernel.h"
+#include "../../Source/DitherNoise.h"
+#include <algorithm>
+#include <cstring>
+#include <tuple>
+
+// the example formulas from the README
+static const char* const exampleFormulas[] = {
+    "x+(t&t>>12)*(t>>4|t>>8)",
+    "t*(42&t>>10)+x*2",
+    "x+t",
+    "x+t&x",
+    "x+sin(t)+t&t<<8",
+    "(t*(4|7&t>>13)>>(~t>>11&1)&128)+(t*(t>>11&t>>13)*(~t>>9&3)&64)"
+};
+
+struct BenchSettings
+{
+    int repeats = 9;                // runs per measurement, the median is reported
+    int samplesPerRun = 1 << 16;    // processBlock benchmarks
+    bool quick = false;             // smaller processBlock matrix, fewer checks
+};
+
+static volatile int sink = 0;   // keeps results alive so the optimizer can't drop the work
+
+// Median wall time of fn() in nanoseconds
+template <typename Fn>
+static double medianNanos (int repeats, Fn&& fn)
+{
+    std::vector<double> times;
+    fn(); // warm up caches and page in buffers
+
+    for (int r=0; r<repeats; ++r)
+    {
+        const auto start = juce::Time::getHighResolutionTicks();
+        fn();
+        const auto end = juce::Time::getHighResolutionTicks();
+        times.push_back(juce::Time::highResolutionTicksToSeconds(end - start) * 1.0e9);
+    }
+
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+static juce::var makeObject (std::initializer_list<std::pair<const char*, juce::var>> properties)
+{
+    auto* obj = new juce::DynamicObject();
+    for (auto& p : properties)
+        obj->setProperty(p.first, p.second);
+    return juce::var(obj);
+}
+
+//==============================================================================
+// Per-opcode cost: t followed by chainLength copies of the op (binary and ternary
+// ops take x as their other operands), minus the cost of the bare t program.
+static const int chainLength = 64;
+
+static Program opChain (OpCode op)
+{
+    Program p;
+    p.code[p.length++] = { OpCode::T, 0 };
+    for (int i=0; i<chainLength; ++i)
+    {
+        for (int k=1; k<numOperands(op); ++k)
+            p.code[p.length++] = { OpCode::X, 0 };
+        p.code[p.length++] = { op, 0 };
+    }
+    p.stackDepth = std::max(1, numOperands(op));
+    p.sourceLength = p.length;
+
+    // lookups go through one array that covers every index they see after the first
+    if (op == OpCode::Lookup)
+    {
+        p.tableLength = 256;
+        for (int i=0; i<p.tableLength; ++i)
+            p.table[i] = (i * 37) & 255;
+        for (int i=0; i<p.length; ++i)
+            if (p.code[i].op == OpCode::Lookup)
+                p.code[i].arg = lookupArg(0, p.tableLength);
+    }
+    return p;
+}
+
+static juce::var benchOpcodes (const BenchSettings& settings, const std::vector<int>& x)
+{
+    static const std::pair<OpCode, const char*> ops[] = {
+        { OpCode::Sin, "sin" }, { OpCode::Cos, "cos" }, { OpCode::Not, "~" },  { OpCode::Neg, "neg" },
+        { OpCode::Add, "+" },   { OpCode::Sub, "-" },   { OpCode::Mul, "*" },  { OpCode::Div, "/" },  { OpCode::Mod, "%" },
+        { OpCode::And, "&" },   { OpCode::Or, "|" },    { OpCode::Xor, "^" },  { OpCode::Shl, "<<" }, { OpCode::Shr, ">>" },
+        { OpCode::Lt, "<" },    { OpCode::Gt, ">" },    { OpCode::Le, "<=" },  { OpCode::Ge, ">=" },  { OpCode::Eq, "==" }, { OpCode::Ne, "!=" },
+        { OpCode::Select, "?:" }, { OpCode::Lookup, "[]" }, { OpCode::Cell, "m[]" }
+    };
+
+    const int n = int(x.size());
+    std::vector<int> out(x.size());
+
+    // ns per sample for each backend, the one-at-a-time ones with a state for m[]
+    ExprState state;
+    auto measure = [&] (const Program& program)
+    {
+        const double interpreter = medianNanos(settings.repeats, [&]
+        {
+            int acc = 0;
+            for (int i=0; i<n; ++i)
+                acc += runProgram(program, uint32_t(i), x[size_t(i)], &state);
+            sink = acc;
+        }) / n;
+
+        const double block = medianNanos(settings.repeats, [&]
+        {
+            evaluateBlock(program, 0, x.data(), out.data(), n);
+            sink = out[size_t(n - 1)];
+        }) / n;
+
+        double jit = -1.0;
+        if (auto compiled = ExprJit::compile(program))
+        {
+            const auto fn = compiled->getFunction();
+            jit = medianNanos(settings.repeats, [&]
+            {
+                int acc = 0;
+                for (int i=0; i<n; ++i)
+                    acc += fn(uint32_t(i), x[size_t(i)], &state);
+                sink = acc;
+            }) / n;
+        }
+        return std::make_tuple(interpreter, block, jit);
+    };
+
+    Program bare;
+    bare.code[bare.length++] = { OpCode::T, 0 };
+    bare.stackDepth = 1;
+    bare.sourceLength = 1;
+    const auto base = measure(bare);
+
+    juce::Array<juce::var> results;
+    for (const auto& op : ops)
+    {
+        const auto cost = measure(opChain(op.first));
+        auto perOp = [] (double chain, double baseline) { return baseline < 0.0 ? juce::var() : juce::var((chain - baseline) / chainLength); };
+
+        results.add(makeObject({
+            { "op",             op.second },
+            { "interpreterNs",  perOp(std::get<0>(cost), std::get<0>(base)) },
+            { "blockNs",        perOp(std::get<1>(cost), std::get<1>(base)) },
+            { "jitNs",          perOp(std::get<2>(cost), std::get<2>(base)) }
+        }));
+    }
+    return results;
+}
+
+//==============================================================================
+// Parse/compile latency for each README formula, and what a second instance
+// loading the same formula pays when it comes out of the shared cache
+static juce::var benchCompile (const BenchSettings& settings)
+{
+    ExprCache cache;
+    juce::Array<juce::var> results;
+    for (auto* formula : exampleFormulas)
+    {
+        const std::string text (formula);
+        Token tokens[maxProgramLength];
+        int numTokens = 0;
+        parseExpr(text, tokens, maxProgramLength, numTokens);
+
+        Program unoptimized;
+        compileTokens(tokens, numTokens, unoptimized, false);
+        const auto optimized = optimizeProgram(unoptimized);
+
+        const double parseNs = medianNanos(settings.repeats, [&] { parseExpr(text, tokens, maxProgramLength, numTokens); sink = numTokens; });
+        const double compileNs = medianNanos(settings.repeats, [&] { compileTokens(tokens, numTokens, unoptimized, false); sink = unoptimized.length; });
+        const double optimizeNs = medianNanos(settings.repeats, [&] { sink = optimizeProgram(unoptimized).length; });
+        const double jitNs = ExprJit::isSupported()
+                               ? medianNanos(settings.repeats, [&] { sink = ExprJit::compile(optimized) != nullptr; })
+                               : -1.0;
+
+        ParseResult result;
+        cache.get(text, result);
+        const double cacheHitNs = medianNanos(settings.repeats, [&] { sink = cache.get(text, result) != nullptr; });
+
+        results.add(makeObject({
+            { "formula",    formula },
+            { "ops",        unoptimized.length },
+            { "optimizedOps", optimized.length },
+            { "parseNs",    parseNs },
+            { "compileNs",  compileNs },
+            { "optimizeNs", optimizeNs },
+            { "jitNs",      jitNs < 0.0 ? juce::var() : juce::var(jitNs) },
+            { "cacheHitNs", cacheHitNs }
+        }));
+    }
+    return results;
+}
+
+//==============================================================================
+// Random formulas over the whole language (variables, arrays, y1, m[]), for the
+// checks. Every operation is bracketed, so precedence can't make one invalid.
+struct FormulaGenerator
+{
+    explicit FormulaGenerator (juce::Random& r) : random(r) {}
+
+    std::string formula()
+    {
+        variables.clear();
+        arrays.clear();
+
+        std::string text;
+        for (int s=random.nextInt(4); s>0; --s)
+            text += statement() + ", ";
+        return text + expression(4);
+    }
+
+private:
+    std::string statement()
+    {
+        static const char* const compound[] = { "+", "-", "*", "/", "%", "&", "|", "^", "<<", ">>" };
+
+        switch (random.nextInt(5))
+        {
+            case 0:
+                if (! variables.empty())
+                    return pick(variables) + compound[random.nextInt(10)] + "=" + expression(3);
+                [[fallthrough]];
+            case 1:
+            {
+                const std::string name (1, char('a' + variables.size() % 6));
+                const std::string text = name + "=" + expression(3);
+                variables.push_back(name);
+                return text;
+            }
+            case 2:
+            {
+                const std::string name (1, char('p' + arrays.size() % 4));
+                arrays.push_back(name);
+                return name + "=" + array();
+            }
+            default:
+                return "m[" + std::to_string(random.nextInt(maxCells)) + "]" + (random.nextBool() ? "=" : "+=") + expression(3);
+        }
+    }
+
+    std::string expression (int depth)
+    {
+        static const char* const binary[] = { "+", "-", "*", "/", "%", "&", "|", "^", "<<", ">>",
+                                              "<", ">", "<=", ">=", "==", "!=" };
+
+        if (depth == 0 || random.nextInt(4) == 0)
+            return leaf();
+
+        switch (random.nextInt(10))
+        {
+            case 0:  return (random.nextBool() ? "~(" : "-(") + expression(depth - 1) + ")";
+            case 1:  return (random.nextBool() ? "sin(" : "cos(") + expression(depth - 1) + ")";
+            case 2:  return "(" + expression(depth - 1) + "?" + expression(depth - 1) + ":" + expression(depth - 1) + ")";
+            case 3:  return (arrays.empty() || random.nextBool() ? array() : pick(arrays)) + "[" + expression(depth - 1) + "]";
+            case 4:  return "m[" + expression(depth - 1) + "]";
+            default: return "(" + expression(depth - 1) + binary[random.nextInt(16)] + expression(depth - 1) + ")";
+        }
+    }
+
+    std::string leaf()
+    {
+        static const char* const numbers[] = { "0", "1", "2", "3", "5", "7", "8", "12", "31", "32", "33", "127",
+                                               "128", "255", "256", "4096", "0xFFFF", "2147483647", "4294967295" };
+        switch (random.nextInt(8))
+        {
+            case 0: case 1: return "t";
+            case 2:         return "x";
+            case 3:         return random.nextInt(4) == 0 ? "y1" : "t";
+            case 4:         return variables.empty() ? "x" : pick(variables);
+            default:        return numbers[random.nextInt(19)];
+        }
+    }
+
+    std::string array()
+    {
+        std::string text = "[";
+        for (int i=random.nextInt(8); i>=0; --i)
+            text += (random.nextInt(4) == 0 ? "-" : "") + std::to_string(random.nextInt(1000)) + (i > 0 ? "," : "]");
+        return text;
+    }
+
+    const std::string& pick (const std::vector<std::string>& names) { return names[size_t(random.nextInt(int(names.size())))]; }
+
+    juce::Random& random;
+    std::vector<std::string> variables, arrays;
+};
+
+// The backends have to agree bit for bit: the JIT (with a state, one sample after the
+// other) against runProgram with a state, and evaluateBlock against runProgram without.
+// Runs the README formulas and random ones, optimized and not, over runs of t from
+// random starting points (t wraps around too) with x both in the 0..255 the plugin
+// feeds and anywhere in the int range. Any mismatch is a failure.
+static juce::var checkBackends (const BenchSettings& settings, int64_t& failures)
+{
+    const int runLength = 1024;
+    const int runsPerReadmeFormula = settings.quick ? 256 : 2048;
+    const int randomFormulas = settings.quick ? 500 : 4000;
+    const int runsPerRandomFormula = 2;
+
+    juce::Random random (2);
+    std::vector<int> x (size_t(runLength)), block (size_t(runLength));
+    int64_t samples = 0, jitSamples = 0, jitMismatches = 0, blockMismatches = 0;
+    int programs = 0;
+    juce::Array<juce::var> mismatched;
+
+    auto check = [&] (const std::string& formula, int runs)
+    {
+        for (bool optimize : { false, true })
+        {
+            Program program;
+            if (! compileExpr(formula, program, optimize).ok())
+                return;
+            ++programs;
+
+            const auto jit = ExprJit::compile(program);
+            const auto fn = jit != nullptr ? jit->getFunction() : nullptr;
+            ExprState interpreterState, jitState;
+            int64_t jitWrong = 0, blockWrong = 0;
+
+            for (int run=0; run<runs; ++run)
+            {
+                const uint32_t tStart = run == 0 ? 0u : uint32_t(random.nextInt());
+                const bool fullRange = (run & 1) != 0;
+                for (auto& v : x)
+                    v = fullRange ? random.nextInt() : random.nextInt(256);
+
+                evaluateBlock(program, tStart, x.data(), block.data(), runLength);
+                for (int i=0; i<runLength; ++i)
+                {
+                    const uint32_t t = tStart + uint32_t(i);
+                    const int expected = runProgram(program, t, x[size_t(i)], &interpreterState);
+                    if (fn != nullptr && fn(t, x[size_t(i)], &jitState) != expected)
+                        ++jitWrong;
+                    if (block[size_t(i)] != runProgram(program, t, x[size_t(i)]))
+                        ++blockWrong;
+                }
+                samples += runLength;
+                jitSamples += fn != nullptr ? runLength : 0;
+            }
+
+            jitMismatches += jitWrong;
+            blockMismatches += blockWrong;
+            if ((jitWrong > 0 || blockWrong > 0) && mismatched.size() < 16)
+                mismatched.add(makeObject({ { "formula", juce::String(formula) }, { "optimized", optimize },
+                                            { "jit", jitWrong }, { "block", blockWrong } }));
+        }
+    };
+
+    for (auto* formula : exampleFormulas)
+        check(formula, runsPerReadmeFormula);
+
+    FormulaGenerator generator (random);
+    for (int i=0; i<randomFormulas; ++i)
+        check(generator.formula(), runsPerRandomFormula);
+
+    failures += jitMismatches + blockMismatches;
+    return makeObject({
+        { "programs",        programs },
+        { "samples",         samples },
+        { "jitSamples",      jitSamples },
+        { "jitMismatches",   jitMismatches },
+        { "blockMismatches", blockMismatches },
+        { "mismatched",      mismatched }
+    });
+}
+
+// A byte table has to play exactly what evaluating the formula would: renders the table
+// of every formula proven periodic and compares two full periods, and a run from a
+// random t, against runProgram on the unoptimized program. The README formulas are
+// checked as they are and with x taken out (all but one read it), along with random
+// t-only formulas.
+static juce::var checkByteTables (const BenchSettings& settings, int64_t& failures)
+{
+    const int randomTables = settings.quick ? 50 : 400;
+    const int maxRandomLog2 = 16;       // keeps the random part short, the README ones go up to 20 bits
+
+    juce::Random random (3);
+    std::vector<uint8_t> table;
+    int64_t samples = 0, mismatches = 0;
+    int tables = 0;
+    juce::Array<juce::var> mismatched;
+
+    // false if the formula doesn't compile or isn't provably periodic
+    auto check = [&] (const std::string& formula, int maxLog2)
+    {
+        Program program, unoptimized;
+        if (! compileExpr(formula, program).ok() || ! compileExpr(formula, unoptimized, false).ok())
+            return false;
+        const int log2 = bytePeriodLog2(program, maxLog2);
+        if (log2 < 0)
+            return false;
+        ++tables;
+
+        const uint32_t size = 1u << log2;
+        table.resize(size);
+        renderByteTable(program, table.data(), size);
+
+        int64_t wrong = 0;
+        auto compare = [&] (uint32_t t) { wrong += table[t & (size - 1)] != uint8_t(runProgram(unoptimized, t, 0) & 0xFF) ? 1 : 0; };
+        for (uint32_t t=0; t<2 * size; ++t)
+            compare(t);
+        const uint32_t tStart = uint32_t(random.nextInt());
+        for (uint32_t i=0; i<4096; ++i)
+            compare(tStart + i);
+        samples += int64_t(2 * size) + 4096;
+
+        mismatches += wrong;
+        if (wrong > 0 && mismatched.size() < 16)
+            mismatched.add(makeObject({ { "formula", juce::String(formula) }, { "periodLog2", log2 }, { "mismatches", wrong } }));
+        return true;
+    };
+
+    for (auto* formula : exampleFormulas)
+    {
+        check(formula, 20);
+        check(juce::String(formula).replace("x", "0").toStdString(), 20);
+    }
+
+    FormulaGenerator generator (random);
+    for (int found=0, tries=0; found < randomTables && tries < randomTables * 1000; ++tries)
+        found += check(generator.formula(), maxRandomLog2) ? 1 : 0;
+
+    failures += mismatches;
+    return makeObject({
+        { "tables",     tables },
+        { "samples",    samples },
+        { "mismatches", mismatches },
+        { "mismatched", mismatched }
+    });
+}
+
+//==============================================================================
+// The scalar loop crushBlock's SSE2/AVX2/NEON kernels have to match bit for bit
+static void crushReference (const float* in, const float* ditherNoise, float* out, int n, const CrushCoefficients& c)
+{
+    for (int i=0; i<n; ++i)
+    {
+        float v = in[i];
+        if (c.dither)
+            v += ditherNoise[i];
+        int q = int(std::lrint(v * float(c.maxVal)));
+        if (c.bitShift > 0)
+            q = int(unsigned(q) << c.bitShift);
+        q = q < -c.maxVal ? -c.maxVal : (q > c.maxVal ? c.maxVal : q);
+        out[i] = float(q) * c.invMaxVal;
+    }
+}
+
+// crushBlock against crushReference for every bit depth and shift, with and without
+// dither, over the input, values exactly halfway between steps and values out of range.
+// The odd length leaves a scalar tail after the vector loops.
+static int64_t countCrushMismatches (const std::vector<float>& input, const std::vector<float>& noise)
+{
+    const int n = int(input.size()) - 3;
+    std::vector<float> in (input.begin(), input.begin() + n);
+    std::vector<float> expected (size_t(n), 0.0f), actual (size_t(n), 0.0f);
+
+    int64_t mismatches = 0;
+    for (int bitDepth=2; bitDepth<=16; ++bitDepth)
+    {
+        const float maxVal = float((1 << (bitDepth - 1)) - 1);
+        for (int i=0; i+1<n; i+=4)
+        {
+            in[size_t(i)] = (float(i % 64) - 32.0f + 0.5f) / maxVal;
+            in[size_t(i + 1)] = (i & 8) != 0 ? 1.5f : -1.5f;
+        }
+
+        for (int bitShift=0; bitShift<=15; ++bitShift)
+        {
+            for (bool ditherOn : { false, true })
+            {
+                const auto c = CrushCoefficients::make(bitDepth, bitShift, ditherOn, true);
+                crushReference(in.data(), noise.data(), expected.data(), n, c);
+                crushBlock(in.data(), noise.data(), actual.data(), n, c);
+                for (int i=0; i<n; ++i)
+                    mismatches += std::memcmp(&expected[size_t(i)], &actual[size_t(i)], sizeof(float)) != 0 ? 1 : 0;
+            }
+        }
+    }
+    return mismatches;
+}
+
+// Steps 3-5 as processBlock did them before the vectorized kernels, one sample at a
+// time: juce::Random TPDF dither, roundToInt, the shift and jlimit. The baseline for
+// crushBlock's rate.
+static void crushOriginal (const float* in, float* out, int n, int bitDepth, int bitShift, bool dither, juce::Random& random)
+{
+    for (int i=0; i<n; ++i)
+    {
+        float ditherVal = 0.0f;
+        if (dither)
+            ditherVal = (random.nextFloat() - random.nextFloat()) * (1.0f / (1 << bitDepth));
+
+        const int maxVal = (1 << (bitDepth - 1)) - 1;
+        const int intSample = juce::roundToInt((in[i] + ditherVal) * maxVal);
+        const int shiftedInt = juce::jlimit(-maxVal, maxVal, intSample << bitShift);
+        out[i] = juce::jlimit(-1.0f, 1.0f, float(shiftedInt) / float(maxVal));
+    }
+}
+
+// The quantizer and the dither generator on their own, for the float path (crushBlock
+// after converting the expression's output) and the integer one (crushValues), and
+// crushBlock with its dither against the original per-sample loop in samples per second
+static juce::var benchCrusher (const BenchSettings& settings, const std::vector<float>& input, int64_t& failures)
+{
+    const int n = int(input.size());
+    std::vector<float> noise(input.size()), out(input.size()), held(input.size()), integerOut(input.size()), generated(input.size());
+    std::vector<int32_t> noiseFixed(input.size());
+
+    // what an expression hands the crusher
+    std::vector<int> values(input.size());
+    for (int i=0; i<n; ++i)
+        values[size_t(i)] = int(input[size_t(i)] * 127.5f + 128);
+
+    DitherNoise dither;
+    dither.setSeed(1);
+    juce::Random random (1);
+
+    juce::Array<juce::var> results;
+    for (int bitDepth : { 2, 8, 16 })
+    {
+        for (bool ditherOn : { false, true })
+        {
+            for (int bitShift : { 0, 3 })
+            {
+                const auto c = CrushCoefficients::make(bitDepth, bitShift, ditherOn, true);
+                const double ns = medianNanos(settings.repeats, [&]
+                {
+                    crushBlock(input.data(), noise.data(), out.data(), n, c);
+                    sink = int(out[size_t(n - 1)] * 1000.0f);
+                });
+
+                const double floatPathNs = medianNanos(settings.repeats, [&]
+                {
+                    for (int i=0; i<n; ++i)
+                        held[size_t(i)] = (values[size_t(i)] & 0xFF) / 127.5f - 1.0f;
+                    crushBlock(held.data(), noise.data(), out.data(), n, c);
+                    sink = int(out[size_t(n - 1)] * 1000.0f);
+                });
+                const double integerPathNs = medianNanos(settings.repeats, [&]
+                {
+                    crushValues(values.data(), 1, noiseFixed.data(), integerOut.data(), n, c);
+                    sink = int(integerOut[size_t(n - 1)] * 1000.0f);
+                });
+
+                // the noise buffers are silent here, so the two paths must agree exactly
+                int mismatches = 0;
+                for (int i=0; i<n; ++i)
+                    mismatches += out[size_t(i)] != integerOut[size_t(i)] ? 1 : 0;
+
+                // both with dither generated as they go, so the rates compare like for like
+                const double originalNs = medianNanos(settings.repeats, [&]
+                {
+                    crushOriginal(input.data(), out.data(), n, bitDepth, bitShift, ditherOn, random);
+                    sink = int(out[size_t(n - 1)] * 1000.0f);
+                });
+                const double ditheredNs = medianNanos(settings.repeats, [&]
+                {
+                    if (ditherOn)
+                        dither.fillTpdf(generated.data(), n, c.ditherScale);
+                    crushBlock(input.data(), generated.data(), out.data(), n, c);
+                    sink = int(out[size_t(n - 1)] * 1000.0f);
+                });
+
+                results.add(makeObject({
+                    { "bitDepth", bitDepth }, { "dither", ditherOn }, { "bitShift", bitShift },
+                    { "nsPerSample", ns / n },
+                    { "floatPathNsPerSample", floatPathNs / n },
+                    { "integerPathNsPerSample", integerPathNs / n },
+                    { "integerPathMismatches", mismatches },
+                    { "originalSamplesPerSecond", n / (originalNs * 1.0e-9) },
+                    { "crushBlockSamplesPerSecond", n / (ditheredNs * 1.0e-9) },
+                    { "speedup", originalNs / ditheredNs }
+                }));
+            }
+        }
+    }
+
+    const double ditherNs = medianNanos(settings.repeats, [&]
+    {
+        dither.fillTpdf(noise.data(), n, 1.0f / 256.0f);
+        sink = int(noise[size_t(n - 1)] * 1000.0f);
+    });
+
+    // noise is filled now, so the dithered kernels get checked with real dither
+    const int64_t simdMismatches = countCrushMismatches(input, noise);
+    failures += simdMismatches;
+
+   #if defined(__AVX2__)
+    const char* simd = "AVX2";
+   #elif defined(__SSE2__) || defined(_M_X64)
+    const char* simd = "SSE2";
+   #elif defined(__aarch64__) || defined(_M_ARM64)
+    const char* simd = "NEON";
+   #else
+    const char* simd = "none";
+   #endif
+
+    return makeObject({ { "crushBlock", results }, { "ditherNsPerSample", ditherNs / n },
+                        { "simd", simd }, { "simdMismatches", simdMismatches } });
+}
+
+//==============================================================================
+// Full processBlock throughput over the parameter matrix
+static const char* const processFormula = "t*(42&t>>10)+x*2";
+
+static const double hostRate = 44100.0;
+
+static void setParameter (RibCrusherAudioProcessor& processor, const juce::String& id, float value)
+{
+    if (auto* param = processor.apvts.getParameter(id))
+        param->setValueNotifyingHost(param->convertTo0to1(value));
+}
+
+static juce::var benchProcessBlock (const BenchSettings& settings, const std::vector<float>& input)
+{
+    const std::vector<int> blockSizes = settings.quick ? std::vector<int> { 64, 512, 4096 }
+                                                       : std::vector<int> { 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+    const std::vector<int> bitDepths  = settings.quick ? std::vector<int> { 8 } : std::vector<int> { 2, 8, 16 };
+    const std::vector<int> reductions = settings.quick ? std::vector<int> { 1, 8 } : std::vector<int> { 1, 2, 8, 64 };
+
+    RibCrusherAudioProcessor processor;
+    ParseResult result;
+    processor.setExpression(processFormula, result);
+
+    juce::Array<juce::var> results;
+    for (int numChannels : { 1, 2 })
+    {
+        const auto channelSet = numChannels == 2 ? juce::AudioChannelSet::stereo() : juce::AudioChannelSet::mono();
+        juce::AudioProcessor::BusesLayout layout;
+        layout.inputBuses.add(channelSet);
+        layout.outputBuses.add(channelSet);
+        processor.releaseResources();
+        processor.setBusesLayout(layout);
+
+        for (int blockSize : blockSizes)
+        for (int bitDepth : bitDepths)
+        for (bool ditherOn : { false, true })
+        for (int reduction : reductions)
+        {
+            setParameter(processor, "BITDEPTH", float(bitDepth));
+            setParameter(processor, "DITHER", ditherOn ? 1.0f : 0.0f);
+            setParameter(processor, "SAMPLERATE", float(hostRate / reduction));
+            setParameter(processor, "MIX", 1.0f);
+
+            processor.ditherSeed = 1;
+            processor.setRateAndBufferSizeDetails(hostRate, blockSize);
+            processor.prepareToPlay(hostRate, blockSize);
+
+            juce::AudioBuffer<float> buffer (numChannels, blockSize);
+            juce::MidiBuffer midi;
+            const int numBlocks = juce::jmax(1, settings.samplesPerRun / blockSize);
+
+            const double ns = medianNanos(settings.repeats, [&]
+            {
+                for (int b=0; b<numBlocks; ++b)
+                {
+                    for (int ch=0; ch<numChannels; ++ch)
+                        buffer.copyFrom(ch, 0, input.data() + (b * blockSize) % (int(input.size()) - blockSize + 1), blockSize);
+                    processor.processBlock(buffer, midi);
+                }
+                sink = int(buffer.getSample(0, blockSize - 1) * 1000.0f);
+            });
+
+            const double samples = double(numBlocks) * blockSize * numChannels;
+            results.add(makeObject({
+                { "blockSize", blockSize }, { "channels", numChannels }, { "bitDepth", bitDepth },
+                { "dither", ditherOn }, { "rateReduction", reduction },
+                { "nsPerSample", ns / samples },
+                // how many times faster than real time at 44.1 kHz
+                { "realtimeFactor", (samples / numChannels / hostRate) / (ns * 1.0e-9) }
+            }));
+        }
+    }
+    processor.releaseResources();
+
+    return makeObject({ { "formula", processFormula }, { "hostRate", hostRate }, { "results", results } });
+}
+
+//==============================================================================
+// Cost of the oversampled "clean crush" mode per factor and filter
+static juce::var benchOversampling (const BenchSettings& settings, const std::vector<float>& input)
+{
+    const int blockSize = 512, numChannels = 2;
+
+    RibCrusherAudioProcessor processor;
+    ParseResult result;
+    processor.setExpression(processFormula, result);
+    setParameter(processor, "BITDEPTH", 8.0f);
+    setParameter(processor, "SAMPLERATE", float(hostRate / 8));
+    setParameter(processor, "MIX", 1.0f);
+
+    juce::Array<juce::var> results;
+    for (const char* filter : { "IIR", "FIR" })
+    {
+        for (int factorIndex=0; factorIndex<4; ++factorIndex)
+        {
+            setParameter(processor, "OSFILTER", juce::String(filter) == "IIR" ? 0.0f : 1.0f);
+            setParameter(processor, "OVERSAMPLING", float(factorIndex));
+
+            processor.ditherSeed = 1;
+            processor.setRateAndBufferSizeDetails(hostRate, blockSize);
+            processor.prepareToPlay(hostRate, blockSize);
+
+            juce::AudioBuffer<float> buffer (numChannels, blockSize);
+            juce::MidiBuffer midi;
+            const int numBlocks = juce::jmax(1, settings.samplesPerRun / blockSize);
+
+            const double ns = medianNanos(settings.repeats, [&]
+            {
+                for (int b=0; b<numBlocks; ++b)
+                {
+                    for (int ch=0; ch<numChannels; ++ch)
+                        buffer.copyFrom(ch, 0, input.data() + (b * blockSize) % (int(input.size()) - blockSize + 1), blockSize);
+                    processor.processBlock(buffer, midi);
+                }
+                sink = int(buffer.getSample(0, blockSize - 1) * 1000.0f);
+            });
+
+            const double samples = double(numBlocks) * blockSize * numChannels;
+            results.add(makeObject({
+                { "factor", 1 << factorIndex }, { "filter", filter },
+                { "latencySamples", processor.getLatencySamples() },
+                { "nsPerSample", ns / samples },
+                { "realtimeFactor", (samples / numChannels / hostRate) / (ns * 1.0e-9) }
+            }));
+        }
+    }
+    processor.releaseResources();
+
+    return makeObject({ { "formula", processFormula }, { "blockSize", blockSize }, { "channels", numChannels },
+                        { "bitDepth", 8 }, { "rateReduction", 8 }, { "results", results } });
+}
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    juce::ScopedJuceInitialiser_GUI juceInit;
+
+    BenchSettings settings;
+    juce::File outputFile;
+    juce::StringArray only;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const juce::String arg (argv[i]);
+        const bool hasValue = i + 1 < argc;
+
+        if (arg == "-h" || arg == "--help")
+        {
+            std::cout << "Usage: RibCrusherBench [options]\n"
+                         "  -o, --output <file>   write the JSON there instead of stdout\n"
+                         "  --repeats <n>         runs per measurement (default: 9)\n"
+                         "  --quick               smaller processBlock matrix, fewer checks\n"
+                         "  --only <list>         comma separated: opcodes,compile,backendCheck,tableCheck,crusher,processBlock,oversampling\n"
+                         "Exits with 2 if a check finds backends that disagree.\n";
+            return 0;
+        }
+        else if ((arg == "-o" || arg == "--output") && hasValue)  outputFile = juce::File::getCurrentWorkingDirectory().getChildFile(argv[++i]);
+        else if (arg == "--repeats" && hasValue)                  settings.repeats = juce::jmax(1, juce::String(argv[++i]).getIntValue());
+        else if (arg == "--quick")                                settings.quick = true;
+        else if (arg == "--only" && hasValue)                     only.addTokens(argv[++i], ",", {});
+        else
+        {
+            std::cerr << "Unknown or incomplete option: " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    auto wanted = [&] (const char* name) { return only.isEmpty() || only.contains(name); };
+
+    // fixed input: seeded white noise at -6 dBFS
+    juce::Random random (1);
+    std::vector<float> audio (size_t(1 << 16));
+    std::vector<int> x (size_t(4096));
+    for (auto& s : audio)
+        s = (random.nextFloat() * 2.0f - 1.0f) * 0.5f;
+    for (auto& v : x)
+        v = random.nextInt(256) - 128;
+
+    auto* root = new juce::DynamicObject();
+    root->setProperty("benchmark", "RibCrusher");
+    root->setProperty("schema", 1);
+    root->setProperty("date", juce::Time::getCurrentTime().toISO8601(true));
+    root->setProperty("system", makeObject({
+        { "os",      juce::SystemStats::getOperatingSystemName() },
+        { "cpu",     juce::SystemStats::getCpuModel() },
+        { "cores",   juce::SystemStats::getNumCpus() },
+        { "avx2",    juce::SystemStats::hasAVX2() },
+        { "jit",     ExprJit::isSupported() },
+       #if JUCE_DEBUG
+        { "build",   "Debug" }
+       #else
+        { "build",   "Release" }
+       #endif
+    }));
+    root->setProperty("repeats", settings.repeats);
+
+    int64_t failures = 0;   // mismatches found by the checks
+    if (wanted("opcodes"))      root->setProperty("opcodes", benchOpcodes(settings, x));
+    if (wanted("compile"))      root->setProperty("compile", benchCompile(settings));
+    if (wanted("backendCheck")) root->setProperty("backendCheck", checkBackends(settings, failures));
+    if (wanted("tableCheck"))   root->setProperty("tableCheck", checkByteTables(settings, failures));
+    if (wanted("crusher"))      root->setProperty("crusher", benchCrusher(settings, std::vector<float>(audio.begin(), audio.begin() + 4096), failures));
+    if (wanted("processBlock")) root->setProperty("processBlock", benchProcessBlock(settings, audio));
+    if (wanted("oversampling")) root->setProperty("oversampling", benchOversampling(settings, audio));
+
+    const auto json = juce::JSON::toString(juce::var(root));
+    if (outputFile != juce::File())
+    {
+        if (! outputFile.replaceWithText(json))
+        {
+            std::cerr << "Can't write " << outputFile.getFullPathName() << std::endl;
+            return 1;
+        }
+    }
+    else
+    {
+        std::cout << json << std::endl;
+    }
+
+    if (failures > 0)
+    {
+        std::cerr << failures << " mismatches between backends, see the checks in the output" << std::endl;
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,308 @@
+/*
+  ==============================================================================
+
+    Offline renderer: streams audio files through RibCrusherAudioProcessor
+    without a host, one processor instance per worker thread.
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+#include "../../Source/PluginProcessor.h"
+#include "../../Source/ExprCompiler.h"
+#include <map>
+
+//==============================================================================
+struct RenderSettings
+{
+    juce::String expression { "x" };
+    juce::StringPairArray parameters;   // parameter ID -> value, only the ones given
+    juce::File outputDir;
+    int blockSize = 4096;
+    int numJobs = juce::SystemStats::getNumCpus();
+    uint64_t seed = 1;
+    bool floatPath = false;             // quantize through float, to compare against the integer path
+};
+
+static void printUsage()
+{
+    std::cout << "Usage: RibCrusherRender [options] <input files...>\n"
+                 "  -e, --expr <formula>     bytebeat expression (default: x)\n"
+                 "  --bitdepth <2-16>\n"
+                 "  --samplerate <Hz>\n"
+                 "  --bitshift <0-64>\n"
+                 "  --mix <0-1>\n"
+                 "  --dither on|off\n"
+                 "  --wrap on|off             mask output to 8 bits\n"
+                 "  --oversampling off|2x|4x|8x\n"
+                 "  --osfilter iir|fir        oversampling filter\n"
+                 "  --shared-t on|off         same t on all channels\n"
+                 "  --midi off|mono|poly      play from MIDI notes (renders have none, so the wet signal is silent)\n"
+                 "  -o, --output <dir>        default: next to each input, with a _crushed suffix\n"
+                 "                            (also used for inputs that are in that directory)\n"
+                 "  --block <samples>         processing block size (default: 4096)\n"
+                 "  -j, --jobs <n>            files processed in parallel (default: number of cores)\n"
+                 "  --seed <n>                dither seed, same seed gives identical renders\n"
+                 "  --float-path              quantize through float instead of on ints (for comparing)\n";
+}
+
+// Choices can be given by name, e.g. --oversampling 4x
+static float parseValue (juce::RangedAudioParameter& param, const juce::String& s)
+{
+    if (auto* choice = dynamic_cast<juce::AudioParameterChoice*>(&param))
+        for (int i=0; i<choice->choices.size(); ++i)
+            if (choice->choices[i].equalsIgnoreCase(s))
+                return float(i);
+
+    if (s.equalsIgnoreCase("on") || s.equalsIgnoreCase("true"))   return 1.0f;
+    if (s.equalsIgnoreCase("off") || s.equalsIgnoreCase("false")) return 0.0f;
+    return s.getFloatValue();
+}
+
+//==============================================================================
+// Renders one file, returns an error message or an empty string
+static juce::String renderFile (RibCrusherAudioProcessor& processor, const RenderSettings& settings,
+                                const juce::File& input, const juce::File& output)
+{
+    juce::AudioFormatManager formats;
+    formats.registerBasicFormats();
+
+    std::unique_ptr<juce::AudioFormatReader> reader (formats.createReaderFor(input));
+    if (reader == nullptr)
+        return "unsupported or unreadable file";
+
+    auto* format = formats.findFormatForFileExtension(output.getFileExtension());
+    if (format == nullptr)
+        return "no writer for " + output.getFileExtension();
+
+    // the plugin only does mono and stereo
+    const int numChannels = reader->numChannels > 1 ? 2 : 1;
+    const auto channelSet = numChannels == 2 ? juce::AudioChannelSet::stereo() : juce::AudioChannelSet::mono();
+
+    juce::AudioProcessor::BusesLayout layout;
+    layout.inputBuses.add(channelSet);
+    layout.outputBuses.add(channelSet);
+
+    processor.releaseResources();
+    if (! processor.setBusesLayout(layout))
+        return "unsupported channel layout";
+
+    for (auto& id : settings.parameters.getAllKeys())
+        if (auto* param = processor.apvts.getParameter(id))
+            param->setValueNotifyingHost(param->convertTo0to1(parseValue(*param, settings.parameters[id])));
+
+    processor.latestExpr = settings.expression;
+    processor.apvts.state.setProperty("expression", settings.expression, nullptr);
+    // every worker shares the one compiled copy
+    ParseResult result;
+    processor.setExpression(settings.expression, result);
+
+    processor.ditherSeed = settings.seed;
+    processor.integerPipeline = ! settings.floatPath;
+    processor.setRateAndBufferSizeDetails(reader->sampleRate, settings.blockSize);
+    processor.prepareToPlay(reader->sampleRate, settings.blockSize);
+
+    if (output == input)
+        return "won't overwrite the input";
+    output.deleteFile();
+    std::unique_ptr<juce::OutputStream> stream (output.createOutputStream());
+    if (stream == nullptr)
+        return "can't write " + output.getFullPathName();
+
+    const int bitDepth = format->getPossibleBitDepths().contains(int(reader->bitsPerSample)) ? int(reader->bitsPerSample) : 24;
+    std::unique_ptr<juce::AudioFormatWriter> writer (format->createWriterFor(stream.get(), reader->sampleRate,
+                                                                             unsigned(numChannels), bitDepth, {}, 0));
+    if (writer == nullptr)
+        return "can't create writer";
+    stream.release(); // the writer owns it now
+
+    juce::AudioBuffer<float> buffer (numChannels, settings.blockSize);
+    juce::MidiBuffer midi;
+
+    for (juce::int64 pos = 0; pos < reader->lengthInSamples; pos += settings.blockSize)
+    {
+        const int n = int(juce::jmin(juce::int64(settings.blockSize), reader->lengthInSamples - pos));
+        buffer.setSize(numChannels, n, false, false, true);
+        reader->read(&buffer, 0, n, pos, true, numChannels > 1);
+
+        processor.processBlock(buffer, midi);
+
+        if (! writer->writeFromAudioSampleBuffer(buffer, 0, n))
+            return "write failed";
+    }
+
+    processor.releaseResources();
+    return {};
+}
+
+// Where a file's render goes. Never the input itself: an output directory that
+// holds the input gets the _crushed name too, so originals are never overwritten.
+static juce::File outputFileFor (const RenderSettings& settings, const juce::File& input)
+{
+    const auto crushedName = input.getFileNameWithoutExtension() + "_crushed" + input.getFileExtension();
+    if (settings.outputDir == juce::File())
+        return input.getSiblingFile(crushedName);
+
+    const auto output = settings.outputDir.getChildFile(input.getFileName());
+    return output == input ? settings.outputDir.getChildFile(crushedName) : output;
+}
+
+//==============================================================================
+// Pulls files off a shared list until there are none left
+class RenderWorker  : public juce::Thread
+{
+public:
+    RenderWorker (const RenderSettings& s, const juce::Array<juce::File>& files, std::atomic<int>& next,
+                  juce::CriticalSection& lock, std::atomic<int>& failures)
+        : juce::Thread ("render worker"), settings(s), inputs(files), nextFile(next), outputLock(lock), numFailed(failures)
+    {
+    }
+
+    void run() override
+    {
+        for (int i = nextFile++; i < inputs.size() && ! threadShouldExit(); i = nextFile++)
+        {
+            const auto& input = inputs.getReference(i);
+            const auto output = outputFileFor(settings, input);
+
+            juce::String error;
+            try
+            {
+                error = renderFile(processor, settings, input, output);
+            }
+            catch (const std::exception& e)
+            {
+                error = e.what();
+            }
+
+            const juce::ScopedLock sl (outputLock);
+            if (error.isEmpty())
+            {
+                std::cout << input.getFileName() << " -> " << output.getFullPathName() << std::endl;
+            }
+            else
+            {
+                std::cerr << input.getFileName() << ": " << error << std::endl;
+                ++numFailed;
+            }
+        }
+    }
+
+    // created on the main thread, only used by this worker afterwards
+    RibCrusherAudioProcessor processor;
+
+private:
+    const RenderSettings& settings;
+    const juce::Array<juce::File>& inputs;
+    std::atomic<int>& nextFile;
+    juce::CriticalSection& outputLock;
+    std::atomic<int>& numFailed;
+};
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    juce::ScopedJuceInitialiser_GUI juceInit;
+
+    RenderSettings settings;
+    juce::Array<juce::File> inputs;
+
+    const std::map<juce::String, juce::String> parameterOptions {
+        { "--bitdepth", "BITDEPTH" }, { "--samplerate", "SAMPLERATE" }, { "--bitshift", "BITSHIFT" },
+        { "--mix", "MIX" }, { "--dither", "DITHER" }, { "--wrap", "BYTEWRAP" },
+        { "--oversampling", "OVERSAMPLING" }, { "--osfilter", "OSFILTER" }, { "--shared-t", "SHAREDT" },
+        { "--midi", "MIDIMODE" }
+    };
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const juce::String arg (argv[i]);
+        const bool hasValue = i + 1 < argc;
+
+        if (arg == "-h" || arg == "--help")
+        {
+            printUsage();
+            return 0;
+        }
+        else if ((arg == "-e" || arg == "--expr") && hasValue)       settings.expression = argv[++i];
+        else if ((arg == "-o" || arg == "--output") && hasValue)     settings.outputDir = juce::File::getCurrentWorkingDirectory().getChildFile(argv[++i]);
+        else if (arg == "--block" && hasValue)                       settings.blockSize = juce::jlimit(32, 1 << 16, juce::String(argv[++i]).getIntValue());
+        else if ((arg == "-j" || arg == "--jobs") && hasValue)       settings.numJobs = juce::jmax(1, juce::String(argv[++i]).getIntValue());
+        else if (arg == "--seed" && hasValue)                        settings.seed = uint64_t(juce::String(argv[++i]).getLargeIntValue());
+        else if (arg == "--float-path")                              settings.floatPath = true;
+        else if (parameterOptions.count(arg) > 0 && hasValue)        settings.parameters.set(parameterOptions.at(arg), argv[++i]);
+        else if (arg.startsWith("-"))
+        {
+            std::cerr << "Unknown or incomplete option: " << arg << std::endl;
+            printUsage();
+            return 1;
+        }
+        else
+        {
+            inputs.add(juce::File::getCurrentWorkingDirectory().getChildFile(arg));
+        }
+    }
+
+    if (inputs.isEmpty())
+    {
+        printUsage();
+        return 1;
+    }
+
+    // catch a bad formula once up front instead of once per file
+    {
+        Program program;
+        const auto result = compileExpr(settings.expression.toStdString(), program);
+        if (! result.ok())
+        {
+            std::cerr << "Invalid expression: " << parseErrorMessage(result.error)
+                      << " at column " << result.offset + 1 << std::endl;
+            return 1;
+        }
+    }
+
+    // Two inputs with the same name from different directories (or one given twice)
+    // would be written by two workers at once into the same file, and an output
+    // can't replace another input (x/a.wav -o y/ with y/a.wav in the inputs too)
+    {
+        std::map<juce::String, juce::File> outputs;
+        for (auto& input : inputs)
+        {
+            const auto output = outputFileFor(settings, input);
+            const auto inserted = outputs.emplace(output.getFullPathName(), input);
+            if (! inserted.second)
+            {
+                std::cerr << input.getFullPathName() << " and " << inserted.first->second.getFullPathName()
+                          << " would both be rendered to " << output.getFullPathName() << std::endl;
+                return 1;
+            }
+        }
+        for (auto& input : inputs)
+        {
+            const auto it = outputs.find(input.getFullPathName());
+            if (it != outputs.end())
+            {
+                std::cerr << it->second.getFullPathName() << " would be rendered over the input "
+                          << input.getFullPathName() << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    if (settings.outputDir != juce::File())
+        settings.outputDir.createDirectory();
+
+    std::atomic<int> nextFile { 0 }, numFailed { 0 };
+    juce::CriticalSection outputLock;
+
+    juce::OwnedArray<RenderWorker> workers;
+    for (int i = 0; i < juce::jmin(settings.numJobs, inputs.size()); ++i)
+        workers.add(new RenderWorker(settings, inputs, nextFile, outputLock, numFailed));
+
+    for (auto* w : workers)
+        w->startThread();
+    for (auto* w : workers)
+        w->waitForThreadToExit(-1);
+
+    return numFailed > 0 ? 1 : 0;
+}
@@ -0,0 +1,155 @@
+#include "CrusherKernel.h"
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+ #include <immintrin.h>
+ #define RIBCRUSHER_SSE2 1
+#elif defined(__aarch64__) || defined(_M_ARM64)
+ #include <arm_neon.h>
+ #define RIBCRUSHER_NEON 1
+#endif
+
+template <bool Dither, bool Shift>
+static void crushKernel (const float* in, const float* ditherNoise, float* out, int n, const CrushCoefficients& c)
+{
+    int i = 0;
+    const float maxVal = float(c.maxVal);
+
+   #if RIBCRUSHER_SSE2
+   #if defined(__AVX2__)
+    {
+        const __m256  scale = _mm256_set1_ps(maxVal);
+        const __m256  hi    = _mm256_set1_ps(maxVal);
+        const __m256  lo    = _mm256_set1_ps(-maxVal);
+        const __m256  inv   = _mm256_set1_ps(c.invMaxVal);
+        const __m128i count = _mm_cvtsi32_si128(c.bitShift);
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 v = _mm256_loadu_ps(in + i);
+            if (Dither)
+                v = _mm256_add_ps(v, _mm256_loadu_ps(ditherNoise + i));
+            // rounds to nearest even, same as roundToInt
+            __m256i q = _mm256_cvtps_epi32(_mm256_mul_ps(v, scale));
+            if (Shift)
+                q = _mm256_sll_epi32(q, count);
+            // clamping after the conversion back to float is exact for |q| <= maxVal
+            __m256 f = _mm256_min_ps(_mm256_max_ps(_mm256_cvtepi32_ps(q), lo), hi);
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(f, inv));
+        }
+    }
+   #endif
+    {
+        const __m128  scale = _mm_set1_ps(maxVal);
+        const __m128  hi    = _mm_set1_ps(maxVal);
+        const __m128  lo    = _mm_set1_ps(-maxVal);
+        const __m128  inv   = _mm_set1_ps(c.invMaxVal);
+        const __m128i count = _mm_cvtsi32_si128(c.bitShift);
+
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 v = _mm_loadu_ps(in + i);
+            if (Dither)
+                v = _mm_add_ps(v, _mm_loadu_ps(ditherNoise + i));
+            __m128i q = _mm_cvtps_epi32(_mm_mul_ps(v, scale));
+            if (Shift)
+                q = _mm_sll_epi32(q, count);
+            __m128 f = _mm_min_ps(_mm_max_ps(_mm_cvtepi32_ps(q), lo), hi);
+            _mm_storeu_ps(out + i, _mm_mul_ps(f, inv));
+        }
+    }
+   #elif RIBCRUSHER_NEON
+    {
+        const float32x4_t scale = vdupq_n_f32(maxVal);
+        const float32x4_t hi    = vdupq_n_f32(maxVal);
+        const float32x4_t lo    = vdupq_n_f32(-maxVal);
+        const float32x4_t inv   = vdupq_n_f32(c.invMaxVal);
+        const int32x4_t   count = vdupq_n_s32(c.bitShift);
+
+        for (; i + 4 <= n; i += 4)
+        {
+            float32x4_t v = vld1q_f32(in + i);
+            if (Dither)
+                v = vaddq_f32(v, vld1q_f32(ditherNoise + i));
+            int32x4_t q = vcvtnq_s32_f32(vmulq_f32(v, scale));
+            if (Shift)
+                q = vshlq_s32(q, count);
+            float32x4_t f = vminq_f32(vmaxq_f32(vcvtq_f32_s32(q), lo), hi);
+            vst1q_f32(out + i, vmulq_f32(f, inv));
+        }
+    }
+   #endif
+
+    // scalar tail (and the whole block on other platforms)
+    for (; i < n; ++i)
+    {
+        float v = in[i];
+        if (Dither)
+            v += ditherNoise[i];
+        int q = int(std::lrint(v * maxVal));
+        if (Shift)
+            q = int(unsigned(q) << c.bitShift);
+        q = q < -c.maxVal ? -c.maxVal : (q > c.maxVal ? c.maxVal : q);
+        out[i] = float(q) * c.invMaxVal;
+    }
+}
+
+template <bool Dither, bool Shift, bool Wrap>
+static void crushValuesKernel (const int* values, int stride, const int32_t* ditherNoise, float* out, int n, const CrushCoefficients& c)
+{
+    constexpr int32_t half = 1 << (crushFractionBits - 1);
+
+    // plain loops over int32, left to the compiler to vectorize
+    for (int i=0; i<n; ++i)
+    {
+        const int v = values[i * stride];
+        const int byte = Wrap ? (v & 0xFF) : (v < 0 ? 0 : (v > 255 ? 255 : v));
+        int32_t acc = c.level[byte] + half;
+        if (Dither)
+            acc += ditherNoise[i];
+        int q = acc >> crushFractionBits;
+        if (Shift)
+            q = int(unsigned(q) << c.bitShift);
+        q = q < -c.maxVal ? -c.maxVal : (q > c.maxVal ? c.maxVal : q);
+        out[i] = float(q) * c.invMaxVal;
+    }
+}
+
+template <bool Dither, bool Shift>
+static void crushValuesWrap (const int* values, int stride, const int32_t* ditherNoise, float* out, int n, const CrushCoefficients& c)
+{
+    if (c.wrap) crushValuesKernel<Dither, Shift, true>  (values, stride, ditherNoise, out, n, c);
+    else        crushValuesKernel<Dither, Shift, false> (values, stride, ditherNoise, out, n, c);
+}
+
+void crushValues (const int* values, int stride, const int32_t* ditherNoise, float* out, int n, const CrushCoefficients& c)
+{
+    const bool shift = c.bitShift > 0;
+
+    if (c.dither)
+    {
+        if (shift) crushValuesWrap<true, true>  (values, stride, ditherNoise, out, n, c);
+        else       crushValuesWrap<true, false> (values, stride, ditherNoise, out, n, c);
+    }
+    else
+    {
+        if (shift) crushValuesWrap<false, true>  (values, stride, ditherNoise, out, n, c);
+        else       crushValuesWrap<false, false> (values, stride, ditherNoise, out, n, c);
+    }
+}
+
+void crushBlock (const float* in, const float* ditherNoise, float* out, int n, const CrushCoefficients& c)
+{
+    const bool shift = c.bitShift > 0;
+
+    if (c.dither)
+    {
+        if (shift) crushKernel<true, true>  (in, ditherNoise, out, n, c);
+        else       crushKernel<true, false> (in, ditherNoise, out, n, c);
+    }
+    else
+    {
+        if (shift) crushKernel<false, true>  (in, ditherNoise, out, n, c);
+        else       crushKernel<false, false> (in, ditherNoise, out, n, c);
+    }
+}
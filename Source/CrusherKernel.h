@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+// Integer path: quantizer inputs are fixed point in 1/4096ths of one output step
+constexpr int crushFractionBits = 12;
+
+// Values derived from the bit crusher parameters, worked out once per block
+// so the per-sample code has no divisions or shifts by parameter values.
+struct CrushCoefficients
+{
+    int   bitDepth    = 16;
+    int   bitShift    = 0;
+    int   maxVal      = 32767;      // largest quantized magnitude, 2^(bitDepth-1)-1
+    float invMaxVal   = 1.0f / 32767.0f;
+    float ditherScale = 1.0f / 65536.0f;  // one step of TPDF dither
+    bool  dither      = true;
+    bool  wrap        = true;
+    int32_t ditherLevel = 2047;     // one step of TPDF dither, fixed point
+    // quantizer input for each 8-bit expression value, (v / 127.5 - 1) * maxVal, fixed point
+    int32_t level[256] {};
+
+    static CrushCoefficients make (int bitDepth, int bitShift, bool dither, bool wrap)
+    {
+        CrushCoefficients c;
+        c.bitDepth    = bitDepth < 2 ? 2 : (bitDepth > 16 ? 16 : bitDepth);
+        // |quantized| never exceeds 2^15, so anything past a 15 bit shift saturates
+        // the same way (and doesn't overflow)
+        c.bitShift    = bitShift < 0 ? 0 : (bitShift > 15 ? 15 : bitShift);
+        c.maxVal      = (1 << (c.bitDepth - 1)) - 1;
+        c.invMaxVal   = 1.0f / float(c.maxVal);
+        c.ditherScale = 1.0f / float(1 << c.bitDepth);
+        c.dither      = dither;
+        c.wrap        = wrap;
+        c.ditherLevel = int32_t((int64_t(c.maxVal) << crushFractionBits) >> c.bitDepth);
+        for (int v=0; v<256; ++v)
+        {
+            // rounded half away from zero, the exact value is never halfway (255 is odd)
+            const int64_t scaled = int64_t(2 * v - 255) * c.maxVal * (int64_t(1) << crushFractionBits);
+            c.level[v] = int32_t((scaled + (scaled >= 0 ? 127 : -127)) / 255);
+        }
+        return c;
+    }
+};
+
+// Steps 4 and 5 of processBlock for a run of samples, 4 or 8 lanes at a time:
+//   q = round((in + ditherNoise) * maxVal), shifted left by bitShift,
+//   clamped to [-maxVal, maxVal] and scaled back to [-1, 1].
+// ditherNoise is already scaled by ditherScale and is ignored when dither is off.
+// Dither and shift bypasses are separate compiled kernels, so they cost nothing.
+// Output is bit-identical to the scalar code. in and out may be the same buffer.
+void crushBlock (const float* in, const float* ditherNoise, float* out, int n, const CrushCoefficients& c);
+
+// The same from the expression's integer output (values[i * stride]) with no float
+// round trip before the end: the value is wrapped to 8 bits (clamped to 0..255
+// without wrap), looked up in c.level, dithered, rounded by a shift, shifted left
+// by bitShift and clamped, all on int32, then converted to float once.
+// ditherNoise is fixed point (DitherNoise::fillTpdf with c.ditherLevel).
+// Without dither the output is bit-identical to converting and calling crushBlock,
+// with dither it can differ by one step where the noise lands on a rounding edge.
+void crushValues (const int* values, int stride, const int32_t* ditherNoise, float* out, int n, const CrushCoefficients& c);
@@ -0,0 +1,92 @@
+#include "DitherNoise.h"
+
+static uint64_t splitMix64 (uint64_t& x)
+{
+    uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+void DitherNoise::setSeed (uint64_t seed)
+{
+    for (int l=0; l<numLanes; ++l)
+    {
+        const uint64_t bits = splitMix64(seed);
+        // xorshift gets stuck on zero
+        stateA[l] = uint32_t(bits) != 0 ? uint32_t(bits) : 1u;
+        stateB[l] = uint32_t(bits >> 32) != 0 ? uint32_t(bits >> 32) : 1u;
+    }
+    nextLane = 0;
+}
+
+static inline uint32_t xorshift32 (uint32_t s)
+{
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    return s;
+}
+
+template <typename Sample, typename Convert>
+void DitherNoise::fill (Sample* dest, int n, Convert convert)
+{
+    uint32_t a[numLanes], b[numLanes];
+    for (int l=0; l<numLanes; ++l)
+    {
+        a[l] = stateA[l];
+        b[l] = stateB[l];
+    }
+
+    // lanes are consumed round robin, so the output doesn't depend on how the
+    // host chops up its blocks
+    int i = 0, l = nextLane;
+    for (; l != 0 && i < n; ++i, l = (l + 1) % numLanes)
+    {
+        a[l] = xorshift32(a[l]);
+        b[l] = xorshift32(b[l]);
+        dest[i] = convert(a[l], b[l]);
+    }
+
+    for (; i + numLanes <= n; i += numLanes)
+    {
+        for (int lane=0; lane<numLanes; ++lane)
+        {
+            a[lane] = xorshift32(a[lane]);
+            b[lane] = xorshift32(b[lane]);
+            dest[i + lane] = convert(a[lane], b[lane]);
+        }
+    }
+    for (; i<n; ++i, ++l)
+    {
+        a[l] = xorshift32(a[l]);
+        b[l] = xorshift32(b[l]);
+        dest[i] = convert(a[l], b[l]);
+    }
+
+    nextLane = l % numLanes;
+
+    for (int j=0; j<numLanes; ++j)
+    {
+        stateA[j] = a[j];
+        stateB[j] = b[j];
+    }
+}
+
+void DitherNoise::fillTpdf (float* dest, int n, float scale)
+{
+    // 24 bit uniforms, exactly representable as float
+    const float k = scale * (1.0f / 16777216.0f);
+    fill(dest, n, [k] (uint32_t a, uint32_t b)
+    {
+        return (float(int32_t(a >> 8)) - float(int32_t(b >> 8))) * k;
+    });
+}
+
+void DitherNoise::fillTpdf (int32_t* dest, int n, int32_t scale)
+{
+    fill(dest, n, [scale] (uint32_t a, uint32_t b)
+    {
+        return ((int32_t(a >> 20) - int32_t(b >> 20)) * scale) >> 12;
+    });
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+
+// TPDF dither noise for one channel. Runs numLanes independent pairs of xorshift32
+// generators side by side, so a whole block is filled with one vectorizable loop
+// instead of a serial juce::Random call chain. The same seed always gives the same
+// noise, which keeps offline renders reproducible.
+class DitherNoise
+{
+public:
+    static constexpr int numLanes = 8;
+
+    DitherNoise() { setSeed(0); }
+
+    void setSeed (uint64_t seed);
+
+    // dest[i] = (u1 - u2) * scale with u1, u2 uniform in [0, 1)
+    void fillTpdf (float* dest, int n, float scale);
+    // Fixed point version from the same streams, with 12 bit uniforms:
+    // dest[i] = ((u1 - u2) * scale) >> 12, u1, u2 in [0, 4096)
+    void fillTpdf (int32_t* dest, int n, int32_t scale);
+
+private:
+    template <typename Sample, typename Convert>
+    void fill (Sample* dest, int n, Convert convert);
+
+    uint32_t stateA[numLanes];
+    uint32_t stateB[numLanes];
+    int      nextLane = 0;
+};
@@ -0,0 +1,186 @@
+#include "ExprAnalysis.h"
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+bool readsInput (const Program& program)
+{
+    for (int i=0; i<program.length; ++i)
+        if (program.code[i].op == OpCode::X)
+            return true;
+    return false;
+}
+
+bool usesState (const Program& program)
+{
+    for (int i=0; i<program.length; ++i)
+    {
+        const OpCode op = program.code[i].op;
+        if (op == OpCode::Prev || op == OpCode::Cell || op == OpCode::SetCell)
+            return true;
+    }
+    return false;
+}
+
+namespace
+{
+    struct Node
+    {
+        OpCode  op;
+        int32_t arg;
+        int     a, b, c;
+    };
+
+    struct PeriodFinder
+    {
+        vector<Node> nodes;
+        vector<int>  memo;      // (node, bits) -> low bits of t needed, -1 = not computed yet
+
+        // How many low bits of t decide the low 'bits' bits of node n (0..32)
+        int tBitsNeeded (int n, int bits)
+        {
+            if (bits <= 0)
+                return 0;
+            bits = min(bits, 32);
+
+            int& cached = memo[size_t(n) * 33 + size_t(bits)];
+            if (cached >= 0)
+                return cached;
+
+            const Node& node = nodes[size_t(n)];
+            int result = 32;
+            switch (node.op)
+            {
+                case OpCode::Const: result = 0; break;
+                case OpCode::T:     result = bits; break;
+
+                // low bits of the result only depend on the same low bits of the operands
+                case OpCode::Not:
+                case OpCode::Neg:
+                    result = tBitsNeeded(node.a, bits);
+                    break;
+                case OpCode::Select:
+                    // any bit of the condition can flip which side is picked
+                    result = max({ tBitsNeeded(node.a, 32), tBitsNeeded(node.b, bits), tBitsNeeded(node.c, bits) });
+                    break;
+                case OpCode::And:
+                    // a constant mask hides every bit above its highest set bit
+                    if (nodes[size_t(node.b)].op == OpCode::Const || nodes[size_t(node.a)].op == OpCode::Const)
+                    {
+                        const bool constB = nodes[size_t(node.b)].op == OpCode::Const;
+                        const uint32_t mask = uint32_t(nodes[size_t(constB ? node.b : node.a)].arg)
+                                            & (bits >= 32 ? 0xFFFFFFFFu : ((1u << bits) - 1));
+                        int used = 0;
+                        while (used < 32 && (mask >> used) != 0)
+                            ++used;
+                        result = tBitsNeeded(constB ? node.a : node.b, used);
+                        break;
+                    }
+                    result = max(tBitsNeeded(node.a, bits), tBitsNeeded(node.b, bits));
+                    break;
+                case OpCode::Add: case OpCode::Sub: case OpCode::Mul:
+                case OpCode::Or:  case OpCode::Xor:
+                    result = max(tBitsNeeded(node.a, bits), tBitsNeeded(node.b, bits));
+                    break;
+
+                case OpCode::Shl:
+                case OpCode::Shr:
+                    if (nodes[size_t(node.b)].op == OpCode::Const)
+                    {
+                        const int c = nodes[size_t(node.b)].arg & 31;
+                        // an arithmetic right shift drags in the sign bit once bits+c reaches 32
+                        result = tBitsNeeded(node.a, node.op == OpCode::Shl ? bits - c : bits + c);
+                        break;
+                    }
+                    // variable shift counts: anything goes
+                    result = max(tBitsNeeded(node.a, 32), tBitsNeeded(node.b, 32));
+                    break;
+
+                default:
+                    // comparisons, division, sin/cos, array lookups: every bit of the operands matters
+                    result = max(tBitsNeeded(node.a, 32), node.b >= 0 ? tBitsNeeded(node.b, 32) : 0);
+                    break;
+            }
+
+            cached = result;
+            return result;
+        }
+    };
+}
+
+int bytePeriodLog2 (const Program& program, int maxLog2)
+{
+    if (program.length == 0)
+        return 0;
+    if (readsInput(program) || usesState(program))
+        return -1;
+
+    PeriodFinder finder;
+    vector<int> stack;
+    int regNode[maxRegisters] = {};
+
+    for (int i=0; i<program.length; ++i)
+    {
+        const Instruction ins = program.code[i];
+        switch (ins.op)
+        {
+            case OpCode::Load:
+                stack.push_back(regNode[ins.arg]);
+                break;
+            case OpCode::Store:
+                regNode[ins.arg] = stack.back();
+                break;
+            case OpCode::Pop:
+                stack.pop_back();
+                break;
+            case OpCode::Const:
+            case OpCode::T:
+                finder.nodes.push_back({ins.op, ins.arg, -1, -1, -1});
+                stack.push_back(int(finder.nodes.size()) - 1);
+                break;
+            case OpCode::Sin:
+            case OpCode::Cos:
+            case OpCode::Not:
+            case OpCode::Neg:
+            case OpCode::Lookup:
+                finder.nodes.push_back({ins.op, 0, stack.back(), -1, -1});
+                stack.back() = int(finder.nodes.size()) - 1;
+                break;
+            case OpCode::Select:
+            {
+                int c = stack.back(); stack.pop_back();
+                int b = stack.back(); stack.pop_back();
+                finder.nodes.push_back({ins.op, 0, stack.back(), b, c});
+                stack.back() = int(finder.nodes.size()) - 1;
+                break;
+            }
+            default:
+            {
+                int b = stack.back(); stack.pop_back();
+                finder.nodes.push_back({ins.op, 0, stack.back(), b, -1});
+                stack.back() = int(finder.nodes.size()) - 1;
+                break;
+            }
+        }
+    }
+
+    finder.memo.assign(finder.nodes.size() * 33, -1);
+    const int k = finder.tBitsNeeded(stack.back(), 8);
+    return k <= maxLog2 ? k : -1;
+}
+
+void renderByteTable (const Program& program, uint8_t* dest, uint32_t size)
+{
+    constexpr int chunk = 1024;
+    int x[chunk] = {};
+    int out[chunk];
+
+    for (uint32_t t=0; t<size; t+=chunk)
+    {
+        const int n = int(min<uint32_t>(chunk, size - t));
+        evaluateBlock(program, t, x, out, n);
+        for (int i=0; i<n; ++i)
+            dest[t + uint32_t(i)] = uint8_t(out[i] & 0xFF);
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "ExprCompiler.h"
+
+// Static analysis of compiled expressions.
+
+// True if the program reads the audio input x anywhere.
+bool readsInput(const Program& program);
+
+// True if the program reads y1 or uses m[], so each call depends on the one before
+// and it can only run one sample after the other, with an ExprState.
+bool usesState(const Program& program);
+
+// For programs that only depend on t: the smallest k for which the low 8 bits of
+// the result are proven to repeat every 2^k samples, i.e. only the low k bits of t
+// can reach them through +, -, *, bit ops and constant shifts. Returns -1 if the
+// program reads x, uses state or k would be larger than maxLog2.
+int bytePeriodLog2(const Program& program, int maxLog2 = 20);
+
+// Renders (program(t) & 0xFF) for t = 0 .. size-1. size must be a power of two.
+void renderByteTable(const Program& program, uint8_t* dest, uint32_t size);
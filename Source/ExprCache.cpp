@@ -0,0 +1,133 @@
+#include "ExprCache.h"
+#include "ExprAnalysis.h"
+
+std::atomic<int> ExprCache::nextSerial { 0 };
+
+// The RPN of the parsed formula: spacing, brackets, hex vs decimal and variable names are gone
+static std::string normalizedKey (const Token* tokens, int numTokens)
+{
+    std::string key;
+    key.reserve(size_t(numTokens) * 3);
+    for (int i=0; i<numTokens; ++i)
+    {
+        const Token& token = tokens[i];
+        if (i > 0)
+            key += ' ';
+        switch (token.type)
+        {
+            case TokenType::Number:   key += std::to_string(uint32_t(token.value)); break;
+            case TokenType::Variable: key += 't'; break;
+            case TokenType::Input:    key += 'x'; break;
+            case TokenType::Function: key += token.op == 'c' ? "cos" : "sin"; break;
+            case TokenType::Operator: key += token.op; break;
+            case TokenType::Load:     key += "$" + std::to_string(token.value); break;
+            case TokenType::Store:    key += "=$" + std::to_string(token.value); break;
+            case TokenType::Pop:      key += ','; break;
+            case TokenType::Element:  key += "[" + std::to_string(uint32_t(token.value)); break;
+            case TokenType::Array:    key += "]" + std::to_string(token.value); break;
+            case TokenType::Lookup:   key += "@" + std::to_string(token.value); break;
+            case TokenType::Previous: key += "y1"; break;
+            case TokenType::Cell:     key += 'm'; break;
+            case TokenType::SetCell:  key += "=m" + std::to_string(token.value); break;
+        }
+    }
+    return key;
+}
+
+CompiledExpr::Ptr ExprCache::build (const Program& program, std::string key)
+{
+    CompiledExpr::Ptr expr = new CompiledExpr();
+    expr->program = program;
+    expr->jit = ExprJit::compile(program);
+    expr->readsInput = readsInput(program);
+    expr->stateful = usesState(program);
+    expr->tablePeriodLog2 = bytePeriodLog2(program);
+    expr->serial = ++nextSerial;
+    expr->key = std::move(key);
+    return expr;
+}
+
+CompiledExpr::Ptr ExprCache::makeUncached (const Program& program)
+{
+    return build(program, {});
+}
+
+CompiledExpr::Ptr ExprCache::get (std::string_view text, ParseResult& result)
+{
+    Token tokens[maxProgramLength + 1];
+    int numTokens = 0;
+    result = parseExpr(text, tokens, maxProgramLength + 1, numTokens);
+    if (! result.ok())
+        return nullptr;
+
+    std::string key = normalizedKey(tokens, numTokens);
+    {
+        const juce::ScopedLock sl (lock);
+        auto it = entries.find(key);
+        if (it != entries.end())
+            return it->second;
+    }
+
+    // compile without holding the lock, other instances can keep looking up meanwhile
+    Program program;
+    result = compileTokens(tokens, numTokens, program);
+    if (! result.ok())
+        return nullptr;
+    CompiledExpr::Ptr expr = build(program, key);
+
+    // if another instance compiled the same formula in the meantime, everyone uses the first one
+    const juce::ScopedLock sl (lock);
+    auto inserted = entries.emplace(std::move(key), expr);
+    if (inserted.second)
+        removeUnused();
+    return inserted.first->second;
+}
+
+CompiledExpr::Ptr ExprCache::withByteTable (const CompiledExpr::Ptr& expr)
+{
+    jassert (expr != nullptr && expr->tablePeriodLog2 >= 0);
+    if (! expr->byteTable.empty())
+        return expr;
+
+    if (! expr->key.empty())
+    {
+        const juce::ScopedLock sl (lock);
+        auto it = entries.find(expr->key);
+        if (it != entries.end() && ! it->second->byteTable.empty())
+            return it->second;
+    }
+
+    CompiledExpr::Ptr withTable = new CompiledExpr (*expr);
+    withTable->byteTable.resize(size_t(1) << expr->tablePeriodLog2);
+    renderByteTable(expr->program, withTable->byteTable.data(), uint32_t(withTable->byteTable.size()));
+
+    if (! expr->key.empty())
+    {
+        const juce::ScopedLock sl (lock);
+        auto it = entries.find(expr->key);
+        if (it == entries.end())
+            return withTable;           // dropped while rendering, nobody else wants it
+        if (! it->second->byteTable.empty())
+            return it->second;          // another instance got there first
+        it->second = withTable;
+    }
+    return withTable;
+}
+
+int ExprCache::getNumEntries() const
+{
+    const juce::ScopedLock sl (lock);
+    return int(entries.size());
+}
+
+// Called with the lock held. Only drops entries no instance holds on to.
+void ExprCache::removeUnused()
+{
+    for (auto it = entries.begin(); it != entries.end() && int(entries.size()) > maxEntries;)
+    {
+        if (it->second->getReferenceCount() == 1)
+            it = entries.erase(it);
+        else
+            ++it;
+    }
+}
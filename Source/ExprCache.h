@@ -0,0 +1,50 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "ExprHandoff.h"
+#include <atomic>
+#include <map>
+#include <string>
+
+// Process-wide store of compiled expressions, shared by every plugin instance
+// through a juce::SharedResourcePointer. A formula is parsed, optimized and
+// turned into native code (and its byte table rendered) once, however many
+// instances run it. Entries are immutable and reference counted; the audio
+// thread never looks anything up here, it only sees what ExprHandoff gives it.
+class ExprCache
+{
+public:
+    ExprCache() = default;
+
+    // Message thread (or any thread but the audio one). Returns the shared compiled
+    // form of text, or null with the error in result if it doesn't parse.
+    // Formulas that only differ in spacing or redundant brackets share an entry.
+    // Entries are only ever compiled from their text, so what every instance plays
+    // can't depend on one instance's saved state.
+    CompiledExpr::Ptr get (std::string_view text, ParseResult& result);
+
+    // Wraps a program that didn't come from text (e.g. one read back from saved
+    // state), nothing is shared
+    static CompiledExpr::Ptr makeUncached (const Program& program);
+
+    // Background thread: the version of expr with its byte table, rendered on the
+    // first request and shared after that. expr must have tablePeriodLog2 >= 0.
+    CompiledExpr::Ptr withByteTable (const CompiledExpr::Ptr& expr);
+
+    int getNumEntries() const;
+
+private:
+    // unused entries are kept around until there are this many, so flipping
+    // between a few formulas doesn't compile them again
+    static constexpr int maxEntries = 64;
+
+    static CompiledExpr::Ptr build (const Program& program, std::string key);
+    static std::atomic<int> nextSerial;
+
+    void removeUnused();
+
+    juce::CriticalSection lock;
+    std::map<std::string, CompiledExpr::Ptr, std::less<>> entries;
+
+    JUCE_DECLARE_NON_COPYABLE (ExprCache)
+};
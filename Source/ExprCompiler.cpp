@@ -0,0 +1,398 @@
+#include "ExprCompiler.h"
+#include "ExprOptimizer.h"
+#include <algorithm>
+
+using namespace std;
+
+static OpCode opCodeFor (char op)
+{
+    switch (op)
+    {
+        case '~': return OpCode::Not;
+        case 'N': return OpCode::Neg;
+        case '+': return OpCode::Add;
+        case '-': return OpCode::Sub;
+        case '*': return OpCode::Mul;
+        case '/': return OpCode::Div;
+        case '%': return OpCode::Mod;
+        case '&': return OpCode::And;
+        case '|': return OpCode::Or;
+        case '^': return OpCode::Xor;
+        case 'L': return OpCode::Shl;
+        case 'R': return OpCode::Shr;
+        case '<': return OpCode::Lt;
+        case '>': return OpCode::Gt;
+        case 'A': return OpCode::Le;
+        case 'B': return OpCode::Ge;
+        case '=': return OpCode::Eq;
+        case '!': return OpCode::Ne;
+        case '?': return OpCode::Select;
+        default:  return OpCode::Const;     // the parser never produces anything else
+    }
+}
+
+ParseResult compileTokens (const Token* tokens, int numTokens, Program& program, bool optimize)
+{
+    program = Program();
+    if (numTokens > maxProgramLength)
+        return { ParseError::TooLong, tokens[maxProgramLength].offset };
+
+    int depth = 0;
+    int arrayArgs[maxArrays] = {};
+    int numArrays = 0;
+    for (int i=0; i<numTokens; ++i)
+    {
+        const Token& token = tokens[i];
+        Instruction ins { OpCode::Const, 0 };
+        switch (token.type)
+        {
+            case TokenType::Number:   ins = { OpCode::Const, token.value }; break;
+            case TokenType::Variable: ins.op = OpCode::T; break;
+            case TokenType::Input:    ins.op = OpCode::X; break;
+            case TokenType::Function: ins.op = token.op == 'c' ? OpCode::Cos : OpCode::Sin; break;
+            case TokenType::Operator: ins.op = opCodeFor(token.op); break;
+            case TokenType::Load:     ins = { OpCode::Load, token.value }; break;
+            case TokenType::Store:    ins = { OpCode::Store, token.value }; break;
+            case TokenType::Pop:      ins.op = OpCode::Pop; break;
+            case TokenType::Lookup:   ins = { OpCode::Lookup, token.value }; break;
+            case TokenType::Previous: ins.op = OpCode::Prev; break;
+            case TokenType::Cell:     ins.op = OpCode::Cell; break;
+            case TokenType::SetCell:  ins = { OpCode::SetCell, token.value }; break;
+
+            // array contents go into the table, not the code
+            case TokenType::Element:
+                if (program.tableLength >= maxArrayElements)
+                {
+                    program = Program();
+                    return { ParseError::ArraysTooLarge, token.offset };
+                }
+                program.table[program.tableLength++] = token.value;
+                continue;
+            case TokenType::Array:
+                if (numArrays >= maxArrays || token.value > program.tableLength)
+                {
+                    program = Program();
+                    return { ParseError::ArraysTooLarge, token.offset };
+                }
+                arrayArgs[numArrays++] = lookupArg(program.tableLength - token.value, token.value);
+                continue;
+        }
+
+        if (ins.op == OpCode::Lookup)
+        {
+            if (ins.arg < 0 || ins.arg >= numArrays)
+            {
+                program = Program();
+                return { ParseError::UnknownName, token.offset };
+            }
+            ins.arg = arrayArgs[ins.arg];
+        }
+        if (ins.op == OpCode::Load || ins.op == OpCode::Store)
+        {
+            if (ins.arg < 0 || ins.arg >= maxVariables)
+            {
+                program = Program();
+                return { ParseError::TooManyVariables, token.offset };
+            }
+            program.numRegisters = max(program.numRegisters, ins.arg + 1);
+        }
+        if (ins.op == OpCode::SetCell && (ins.arg < 0 || ins.arg >= maxCells))
+        {
+            program = Program();
+            return { ParseError::BadCellIndex, token.offset };
+        }
+
+        // stack depth is fully known here, so check it once instead of per sample.
+        // parseExpr() output always has its operands, so running short is a bug.
+        if (depth < operandsNeeded(ins.op))
+        {
+            program = Program();
+            return { ParseError::ExpectedOperand, token.offset };
+        }
+        depth += stackEffect(ins.op);
+        if (depth > maxStackDepth)
+        {
+            program = Program();
+            return { ParseError::TooDeep, token.offset };
+        }
+
+        program.stackDepth = max(program.stackDepth, depth);
+        program.code[program.length++] = ins;
+    }
+    program.sourceLength = program.length;
+
+    // anything else is a bug in the parser, see the note above
+    if (program.length > 0 && depth != 1)
+    {
+        program = Program();
+        return { ParseError::NoResult, numTokens > 0 ? tokens[numTokens - 1].offset : 0 };
+    }
+
+    if (optimize)
+        program = optimizeProgram(program);
+    return {};
+}
+
+ParseResult compileExpr (string_view text, Program& program, bool optimize)
+{
+    // one more than fits, so compileTokens() can tell the expression is too long
+    Token tokens[maxProgramLength + 1];
+    int numTokens = 0;
+
+    const ParseResult parsed = parseExpr(text, tokens, maxProgramLength + 1, numTokens);
+    if (! parsed.ok())
+    {
+        program = Program();
+        return parsed;
+    }
+    return compileTokens(tokens, numTokens, program, optimize);
+}
+
+bool verifyProgram (const Program& program)
+{
+    if (program.length < 0 || program.length > maxProgramLength
+     || program.stackDepth < 0 || program.stackDepth > maxStackDepth
+     || program.numRegisters < 0 || program.numRegisters > maxRegisters
+     || program.tableLength < 0 || program.tableLength > maxArrayElements)
+        return false;
+
+    bool written[maxRegisters] = {};
+    int depth = 0;
+    for (int i=0; i<program.length; ++i)
+    {
+        const Instruction ins = program.code[i];
+        if (ins.op > OpCode::SetCell)
+            return false;
+        if (ins.op == OpCode::SetCell && (ins.arg < 0 || ins.arg >= maxCells))
+            return false;
+
+        if (ins.op == OpCode::Lookup && (lookupSize(ins.arg) <= 0 || lookupOffset(ins.arg) + lookupSize(ins.arg) > program.tableLength))
+            return false;
+
+        if (ins.op == OpCode::Load || ins.op == OpCode::Store)
+        {
+            if (ins.arg < 0 || ins.arg >= program.numRegisters)
+                return false;
+            if (ins.op == OpCode::Store)
+            {
+                if (depth < 1)
+                    return false;
+                written[ins.arg] = true;
+                continue;
+            }
+            if (! written[ins.arg])
+                return false;
+        }
+
+        if (depth < operandsNeeded(ins.op))
+            return false;
+        depth += stackEffect(ins.op);
+        if (depth > program.stackDepth)
+            return false;
+    }
+    // the analysis and the optimizer take the result from the top
+    return program.length == 0 || depth > 0;
+}
+
+int runProgram (const Program& program, uint32_t t, int x, ExprState* state)
+{
+    int stack[maxStackDepth];
+    int regs[maxRegisters];
+    int sp = 0;
+    ExprState fresh;
+    ExprState& s = state != nullptr ? *state : fresh;
+
+    for (int i=0; i<program.length; ++i)
+    {
+        const Instruction ins = program.code[i];
+        switch (ins.op)
+        {
+            case OpCode::Const: stack[sp++] = ins.arg; break;
+            case OpCode::T:     stack[sp++] = static_cast<int>(t); break;
+            case OpCode::X:     stack[sp++] = x; break;
+            case OpCode::Load:  stack[sp++] = regs[ins.arg]; break;
+            case OpCode::Store: regs[ins.arg] = stack[sp-1]; break;
+            case OpCode::Pop:   --sp; break;
+            case OpCode::Prev:  stack[sp++] = s.y1; break;
+            case OpCode::Cell:  stack[sp-1] = s.cells[cellIndex(stack[sp-1])]; break;
+            case OpCode::SetCell: s.cells[ins.arg] = stack[sp-1]; break;
+            case OpCode::Lookup:
+                stack[sp-1] = applyLookup(program, ins.arg, stack[sp-1]);
+                break;
+            case OpCode::Sin:
+            case OpCode::Cos:
+            case OpCode::Not:
+            case OpCode::Neg:
+                stack[sp-1] = applyUnary(ins.op, stack[sp-1]);
+                break;
+            case OpCode::Select:
+                sp -= 2;
+                stack[sp-1] = applySelect(stack[sp-1], stack[sp], stack[sp+1]);
+                break;
+            default:
+                --sp;
+                stack[sp-1] = applyBinary(ins.op, stack[sp-1], stack[sp]);
+                break;
+        }
+    }
+    s.y1 = sp > 0 ? stack[sp-1] : 0;
+    return s.y1;
+}
+
+template <typename Fn>
+static inline void forLanes (int* a, const int* b, int len, Fn fn)
+{
+    for (int i=0; i<len; ++i)
+        a[i] = fn(a[i], b[i]);
+}
+
+// The block evaluator, with fillT(dest, base, len) writing t for lanes base..base+len-1
+template <typename FillT>
+static void evaluateLanes (const Program& program, const int* x, int* out, int n, FillT fillT)
+{
+    alignas(32) int stack[maxStackDepth][blockLanes];
+    alignas(32) int regs[maxRegisters][blockLanes];
+    alignas(32) int cells[maxCells][blockLanes];
+
+    const bool hasCells = any_of(program.code, program.code + program.length, [] (const Instruction& ins)
+                                 { return ins.op == OpCode::Cell || ins.op == OpCode::SetCell; });
+
+    for (int base=0; base<n; base+=blockLanes)
+    {
+        const int len = min(blockLanes, n - base);
+        int sp = 0;
+        if (hasCells)
+            fill(&cells[0][0], &cells[0][0] + maxCells * blockLanes, 0);
+
+        for (int k=0; k<program.length; ++k)
+        {
+            const Instruction ins = program.code[k];
+            switch (ins.op)
+            {
+                case OpCode::Const:
+                    fill(stack[sp], stack[sp] + len, ins.arg);
+                    ++sp;
+                    break;
+                case OpCode::T:
+                    fillT(stack[sp], base, len);
+                    ++sp;
+                    break;
+                case OpCode::X:
+                    copy(x + base, x + base + len, stack[sp]);
+                    ++sp;
+                    break;
+                case OpCode::Load:
+                    copy(regs[ins.arg], regs[ins.arg] + len, stack[sp]);
+                    ++sp;
+                    break;
+                case OpCode::Store:
+                    copy(stack[sp-1], stack[sp-1] + len, regs[ins.arg]);
+                    break;
+                case OpCode::Pop:
+                    --sp;
+                    break;
+                case OpCode::Prev:
+                    fill(stack[sp], stack[sp] + len, 0);
+                    ++sp;
+                    break;
+                case OpCode::Cell:
+                    for (int i=0; i<len; ++i)
+                        stack[sp-1][i] = cells[cellIndex(stack[sp-1][i])][i];
+                    break;
+                case OpCode::SetCell:
+                    copy(stack[sp-1], stack[sp-1] + len, cells[ins.arg]);
+                    break;
+                case OpCode::Lookup:
+                    for (int i=0; i<len; ++i)
+                        stack[sp-1][i] = applyLookup(program, ins.arg, stack[sp-1][i]);
+                    break;
+                case OpCode::Not:
+                    for (int i=0; i<len; ++i)
+                        stack[sp-1][i] = ~stack[sp-1][i];
+                    break;
+                case OpCode::Neg:
+                    for (int i=0; i<len; ++i)
+                        stack[sp-1][i] = int(0u - uint32_t(stack[sp-1][i]));
+                    break;
+                case OpCode::Select:
+                {
+                    sp -= 2;
+                    int* cond = stack[sp-1];
+                    const int* a = stack[sp];
+                    const int* b = stack[sp+1];
+                    for (int i=0; i<len; ++i)
+                        cond[i] = cond[i] != 0 ? a[i] : b[i];
+                    break;
+                }
+                case OpCode::Sin:
+                case OpCode::Cos:
+                    for (int i=0; i<len; ++i)
+                        stack[sp-1][i] = applyUnary(ins.op, stack[sp-1][i]);
+                    break;
+                default:
+                {
+                    --sp;
+                    int* a = stack[sp-1];
+                    const int* b = stack[sp];
+                    switch (ins.op)
+                    {
+                        case OpCode::Add: forLanes(a, b, len, [] (int p, int q) { return int(uint32_t(p) + uint32_t(q)); }); break;
+                        case OpCode::Sub: forLanes(a, b, len, [] (int p, int q) { return int(uint32_t(p) - uint32_t(q)); }); break;
+                        case OpCode::Mul: forLanes(a, b, len, [] (int p, int q) { return int(uint32_t(p) * uint32_t(q)); }); break;
+                        case OpCode::And: forLanes(a, b, len, [] (int p, int q) { return p & q; }); break;
+                        case OpCode::Or:  forLanes(a, b, len, [] (int p, int q) { return p | q; }); break;
+                        case OpCode::Xor: forLanes(a, b, len, [] (int p, int q) { return p ^ q; }); break;
+                        case OpCode::Shl: forLanes(a, b, len, [] (int p, int q) { return int(uint32_t(p) << (uint32_t(q) & 31)); }); break;
+                        case OpCode::Shr: forLanes(a, b, len, [] (int p, int q) { return p >> (uint32_t(q) & 31); }); break;
+                        case OpCode::Lt:  forLanes(a, b, len, [] (int p, int q) { return int(p < q); }); break;
+                        case OpCode::Gt:  forLanes(a, b, len, [] (int p, int q) { return int(p > q); }); break;
+                        case OpCode::Le:  forLanes(a, b, len, [] (int p, int q) { return int(p <= q); }); break;
+                        case OpCode::Ge:  forLanes(a, b, len, [] (int p, int q) { return int(p >= q); }); break;
+                        case OpCode::Eq:  forLanes(a, b, len, [] (int p, int q) { return int(p == q); }); break;
+                        case OpCode::Ne:  forLanes(a, b, len, [] (int p, int q) { return int(p != q); }); break;
+                        default:
+                            // division has per-lane special cases, no point vectorizing it
+                            for (int i=0; i<len; ++i)
+                                a[i] = applyBinary(ins.op, a[i], b[i]);
+                            break;
+                    }
+                    break;
+                }
+            }
+        }
+
+        if (sp > 0)
+            copy(stack[sp-1], stack[sp-1] + len, out + base);
+        else
+            fill(out + base, out + base + len, 0);
+    }
+}
+
+void evaluateBlock (const Program& program, uint32_t tStart, const int* x, int* out, int n, int lanesPerT)
+{
+    if (lanesPerT == 1)
+    {
+        evaluateLanes(program, x, out, n, [tStart] (int* dest, int base, int len)
+        {
+            for (int i=0; i<len; ++i)
+                dest[i] = static_cast<int>(tStart + uint32_t(base + i));
+        });
+    }
+    else
+    {
+        evaluateLanes(program, x, out, n, [tStart, lanesPerT] (int* dest, int base, int len)
+        {
+            for (int i=0; i<len; ++i)
+                dest[i] = static_cast<int>(tStart + uint32_t((base + i) / lanesPerT));
+        });
+    }
+}
+
+void evaluateBlock (const Program& program, const uint32_t* t, const int* x, int* out, int n)
+{
+    evaluateLanes(program, x, out, n, [t] (int* dest, int base, int len)
+    {
+        for (int i=0; i<len; ++i)
+            dest[i] = static_cast<int>(t[base + i]);
+    });
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "ExprParser.h"
+#include <cstdint>
+#include <cmath>
+
+// Bytecode for bytebeat expressions. parseExpr() output is compiled once
+// into a flat Program so the audio thread never touches Token/std::string.
+
+constexpr int maxProgramLength = 1024;
+constexpr int maxStackDepth    = 64;
+constexpr int maxRegisters     = 16;
+static_assert(maxVariables <= maxRegisters, "every variable needs a register");
+
+enum class OpCode : uint8_t
+{
+    Const, T, X,
+    Prev,               // the result of the call before, ExprState::y1
+    Load, Store,        // variables and shared sub-expressions, arg is the register index
+    Pop,                // drops the top, after a statement
+    Sin, Cos, Not, Neg,
+    Add, Sub, Mul, Div, Mod,
+    And, Or, Xor, Shl, Shr,
+    Lt, Gt, Le, Ge, Eq, Ne,
+    Select,             // cond ? a : b, pops all three (both sides are always evaluated)
+    Lookup,             // replaces an index with Program::table[offset + index], 0 out of range
+    Cell,               // replaces an index with ExprState::cells[index & 15]
+    SetCell             // ExprState::cells[arg] = the top, which stays on the stack
+};
+
+// Bump whenever OpCode or the meaning of an instruction changes. Programs stored
+// in plugin state by another version are compiled again from their text instead.
+constexpr int programFormatVersion = 3;
+
+// Lookup's arg: where its array starts in Program::table and how long it is
+inline int32_t lookupArg(int offset, int size) { return int32_t(offset | (size << 16)); }
+inline int     lookupOffset(int32_t arg)       { return arg & 0xFFFF; }
+inline int     lookupSize(int32_t arg)         { return arg >> 16; }
+
+struct Instruction
+{
+    OpCode  op;
+    int32_t arg;
+};
+
+// Plain data only, safe to copy around and to memcpy.
+struct Program
+{
+    Instruction code[maxProgramLength];
+    int         length     = 0;
+    int         stackDepth = 0;
+    int         numRegisters = 0;
+    int         sourceLength = 0;   // ops before optimizing, for reporting
+    int32_t     table[maxArrayElements];    // the constant arrays, one after the other
+    int         tableLength = 0;
+};
+
+// What y1 and m[] read: kept by the caller from one call of a program to the next,
+// one per channel (or voice). The block is a cache line, so channels never share one.
+struct alignas(64) ExprState
+{
+    int32_t cells[maxCells] {};
+    int32_t y1 = 0;
+};
+
+// Parses and compiles in one go. On error the program is left empty (always 0)
+// and the result says what went wrong where. Never throws.
+// With optimize set the result goes through optimizeProgram() (see ExprOptimizer.h).
+ParseResult compileExpr(string_view text, Program& program, bool optimize = true);
+// Same for already parsed tokens, fails with TooLong/TooDeep if they don't fit in a Program
+ParseResult compileTokens(const Token* tokens, int numTokens, Program& program, bool optimize = true);
+// With a state its cells are read and written and y1 is set to the result. Without
+// one, cells and y1 start at 0 on every call.
+int runProgram(const Program& program, uint32_t t, int x, ExprState* state = nullptr);
+
+// For programs that didn't come out of the compiler (e.g. read back from saved state):
+// true if every backend can run it safely, i.e. known opcodes, no stack underflow,
+// stackDepth and numRegisters within limits, no register read before it's written
+// every Lookup inside the table and every SetCell to a cell that exists.
+bool verifyProgram(const Program& program);
+
+// Evaluates n samples at once: out[i] = runProgram(program, tStart + i/lanesPerT, x[i]).
+// With lanesPerT > 1 the input is interleaved channels that share one t per frame.
+// Each opcode is dispatched once per lane group and applied over plain int32 arrays,
+// which the compiler turns into SSE/AVX2/NEON loops. Results are bit-identical to runProgram.
+// Lanes don't pass state on to each other, each one starts with cells and y1 at 0 like
+// runProgram without a state: programs that use them have to be run one call at a time.
+constexpr int blockLanes = 32;
+void evaluateBlock(const Program& program, uint32_t tStart, const int* x, int* out, int n, int lanesPerT = 1);
+// Same with its own t for every lane, e.g. for voices that each run at their own t
+void evaluateBlock(const Program& program, const uint32_t* t, const int* x, int* out, int n);
+
+//==============================================================================
+// Operator semantics shared by every backend. Arithmetic wraps around and shift
+// counts are masked to 5 bits, so every backend gives identical results.
+
+inline int applyUnary(OpCode op, int a)
+{
+    switch (op)
+    {
+        case OpCode::Sin: return static_cast<int>(127.5f * (std::sin(double(a)) + 1.0f));
+        case OpCode::Cos: return static_cast<int>(127.5f * (std::cos(double(a)) + 1.0f));
+        case OpCode::Not: return ~a;
+        case OpCode::Neg: return int(0u - uint32_t(a));
+        default:          return a;
+    }
+}
+
+inline int applyBinary(OpCode op, int a, int b)
+{
+    const uint32_t ua = uint32_t(a), ub = uint32_t(b);
+    switch (op)
+    {
+        case OpCode::Add: return int(ua + ub);
+        case OpCode::Sub: return int(ua - ub);
+        case OpCode::Mul: return int(ua * ub);
+        // x/0 and x%0 give 0, INT_MIN/-1 wraps instead of trapping
+        case OpCode::Div: return b == 0 ? 0 : (b == -1 ? int(0u - ua) : a / b);
+        case OpCode::Mod: return (b == 0 || b == -1) ? 0 : a % b;
+        case OpCode::And: return a & b;
+        case OpCode::Or:  return a | b;
+        case OpCode::Xor: return a ^ b;
+        case OpCode::Shl: return int(ua << (ub & 31));
+        case OpCode::Shr: return a >> (ub & 31);
+        case OpCode::Lt:  return a < b;
+        case OpCode::Gt:  return a > b;
+        case OpCode::Le:  return a <= b;
+        case OpCode::Ge:  return a >= b;
+        case OpCode::Eq:  return a == b;
+        case OpCode::Ne:  return a != b;
+        default:          return 0;
+    }
+}
+
+inline int applySelect(int cond, int a, int b) { return cond != 0 ? a : b; }
+
+inline int applyLookup(const Program& program, int32_t arg, int index)
+{
+    return uint32_t(index) < uint32_t(lookupSize(arg)) ? program.table[lookupOffset(arg) + index] : 0;
+}
+
+// m[index] wraps the index around instead of reading past the cells
+static_assert((maxCells & (maxCells - 1)) == 0, "cell indices are masked");
+inline int cellIndex(int index) { return index & (maxCells - 1); }
+
+inline bool isUnary(OpCode op)   { return op >= OpCode::Sin && op <= OpCode::Neg; }
+inline bool isBinary(OpCode op)  { return op >= OpCode::Add && op <= OpCode::Ne; }
+inline bool isTernary(OpCode op) { return op == OpCode::Select; }
+inline int  numOperands(OpCode op) { return isTernary(op) ? 3 : (isBinary(op) ? 2 : ((isUnary(op) || op == OpCode::Lookup || op == OpCode::Cell || op == OpCode::Pop) ? 1 : 0)); }
+// how much an instruction grows the stack by
+inline int  stackEffect(OpCode op) { return op == OpCode::Pop ? -1 : ((op == OpCode::Store || op == OpCode::SetCell) ? 0 : 1 - numOperands(op)); }
+// Store and SetCell don't pop, but need a value to write
+inline int  operandsNeeded(OpCode op) { return (op == OpCode::Store || op == OpCode::SetCell) ? 1 : numOperands(op); }
@@ -0,0 +1,64 @@
+#include "ExprHandoff.h"
+
+ExprHandoff::~ExprHandoff()
+{
+    reclaim();
+
+    if (auto* p = pending.exchange(nullptr))
+        p->decReferenceCount();
+    if (active != nullptr)
+        active->decReferenceCount();
+}
+
+void ExprHandoff::publish (CompiledExpr::Ptr expr)
+{
+    if (expr == nullptr)
+        return;
+
+    // the slot holds its own reference until the audio thread takes it over
+    expr->incReferenceCount();
+
+    // if the audio thread hasn't picked up the previous one yet it never will,
+    // so it's safe to let it go here
+    if (auto* skipped = pending.exchange(expr.get()))
+        skipped->decReferenceCount();
+}
+
+bool ExprHandoff::acquire()
+{
+    if (pending.load(std::memory_order_relaxed) == nullptr)
+        return false;
+
+    // keep the current one until there's room to retire it
+    if (active != nullptr && retiredFifo.getFreeSpace() == 0)
+        return false;
+
+    auto* next = pending.exchange(nullptr, std::memory_order_acquire);
+    if (next == nullptr)
+        return false;
+
+    if (active != nullptr)
+    {
+        const auto scope = retiredFifo.write(1);
+        if (scope.blockSize1 > 0)
+            retired[size_t(scope.startIndex1)] = active;
+    }
+    active = next;
+    return true;
+}
+
+int ExprHandoff::useTimeSlice()
+{
+    reclaim();
+    return 100;
+}
+
+void ExprHandoff::reclaim()
+{
+    const auto scope = retiredFifo.read(retiredFifo.getNumReady());
+    scope.forEach([this] (int index)
+    {
+        retired[size_t(index)]->decReferenceCount();
+        retired[size_t(index)] = nullptr;
+    });
+}
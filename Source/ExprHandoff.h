@@ -0,0 +1,62 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "ExprCompiler.h"
+#include "ExprJit.h"
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A compiled expression as the audio thread sees it. Never modified once published.
+struct CompiledExpr : public juce::ReferenceCountedObject
+{
+    using Ptr = juce::ReferenceCountedObjectPtr<CompiledExpr>;
+
+    Program                  program;
+    std::shared_ptr<ExprJit> jit;       // null if there's no native code for this platform
+    std::vector<uint8_t>     byteTable; // (program(t) & 0xFF) over one period, empty if not rendered (yet)
+    bool                     readsInput = true; // false if the result is the same for every channel
+    bool                     stateful = false;  // uses y1 or m[], so it runs one sample at a time
+    int                      tablePeriodLog2 = -1;  // period of byteTable, -1 if it can't have one
+    int                      serial = 0;    // same for every version of one expression
+    std::string              key;       // ExprCache key, empty if it isn't cached
+};
+
+// Wait-free handoff of compiled expressions from the message thread to the audio thread.
+//
+// publish() drops the new expression into the pending slot with an atomic exchange.
+// acquire() swaps it in at the start of a block and queues the one it replaces on a
+// small FIFO, so the audio thread never releases memory. The FIFO is emptied by
+// useTimeSlice() on a background thread.
+class ExprHandoff  : public juce::TimeSliceClient
+{
+public:
+    ExprHandoff() = default;
+    ~ExprHandoff() override;
+
+    // message thread
+    void publish (CompiledExpr::Ptr expr);
+
+    // audio thread: picks up the newest expression, returns true if it changed
+    bool acquire();
+    // audio thread: the expression to run for this block, may be null before the first publish()
+    const CompiledExpr* current() const { return active; }
+
+    // background thread: releases retired expressions
+    int useTimeSlice() override;
+
+private:
+    static constexpr int retiredCapacity = 32;
+
+    std::atomic<CompiledExpr*> pending { nullptr };
+    CompiledExpr* active = nullptr;
+
+    juce::AbstractFifo retiredFifo { retiredCapacity };
+    std::array<CompiledExpr*, retiredCapacity> retired {};
+
+    void reclaim();
+
+    JUCE_DECLARE_NON_COPYABLE (ExprHandoff)
+};
@@ -0,0 +1,317 @@
+#include "ExprJit.h"
+#include <vector>
+#include <cstring>
+#include <cstddef>
+
+#if RIBCRUSHER_JIT
+ #include <sys/mman.h>
+ #include <unistd.h>
+#endif
+
+using namespace std;
+
+#if RIBCRUSHER_JIT
+
+// sin/cos are called out of the generated code so they round exactly like runProgram
+static int jitSin (int a) { return applyUnary(OpCode::Sin, a); }
+static int jitCos (int a) { return applyUnary(OpCode::Cos, a); }
+
+namespace
+{
+    // Code layout (System V ABI): t arrives in edi, x in esi, the ExprState in rdx.
+    // The top of the expression stack lives in eax, the rest on the machine stack.
+    // Registers (Load/Store) are 4 byte slots below rbp, the state pointer is kept
+    // below them, as calls and Select use rdx. Constant arrays follow the code.
+    constexpr uint8_t frameSize = maxRegisters * 4 + 16;    // keeps rsp 16 byte aligned
+    constexpr uint8_t stateSlot = uint8_t(int8_t(-(maxRegisters * 4 + 8)));
+    constexpr uint8_t y1Offset  = uint8_t(offsetof(ExprState, y1));
+    static_assert(offsetof(ExprState, y1) < 128 && maxCells * 4 <= 128, "state offsets have to fit a disp8");
+
+    struct Assembler
+    {
+        vector<uint8_t> bytes;
+        int  depth = 0;     // expression stack depth
+        int  pushes = 0;    // 8 byte pushes since the prologue, for call alignment
+        vector<pair<size_t, int>> tableFixups;   // rip relative displacement, table element it points to
+
+        void emit (initializer_list<uint8_t> b) { bytes.insert(bytes.end(), b); }
+
+        void emit32 (int32_t v)
+        {
+            uint8_t b[4];
+            memcpy(b, &v, 4);
+            bytes.insert(bytes.end(), b, b + 4);
+        }
+
+        void emit64 (uint64_t v)
+        {
+            uint8_t b[8];
+            memcpy(b, &v, 8);
+            bytes.insert(bytes.end(), b, b + 8);
+        }
+
+        size_t jump (uint8_t opcode)
+        {
+            emit({ opcode, 0 });
+            return bytes.size() - 1;
+        }
+
+        void land (size_t at)
+        {
+            bytes[at] = uint8_t(int8_t(bytes.size() - (at + 1)));
+        }
+
+        // makes room for a new top of stack in eax
+        void pushValue()
+        {
+            if (depth > 0)
+            {
+                emit({ 0x50 });                     // push rax
+                ++pushes;
+            }
+            ++depth;
+        }
+
+        // moves the second operand to ecx: eax = a, ecx = b
+        void popOperands()
+        {
+            emit({ 0x89, 0xC1 });                   // mov ecx, eax
+            emit({ 0x58 });                         // pop rax
+            --pushes;
+            --depth;
+        }
+
+        void callHelper (int (*fn)(int))
+        {
+            emit({ 0x57, 0x56 });                   // push rdi; push rsi
+            const bool pad = (pushes & 1) != 0;
+            if (pad)
+                emit({ 0x48, 0x83, 0xEC, 0x08 });   // sub rsp, 8
+            emit({ 0x89, 0xC7 });                   // mov edi, eax
+            emit({ 0x48, 0xB8 });                   // mov rax, fn
+            emit64(reinterpret_cast<uint64_t>(fn));
+            emit({ 0xFF, 0xD0 });                   // call rax
+            if (pad)
+                emit({ 0x48, 0x83, 0xC4, 0x08 });   // add rsp, 8
+            emit({ 0x5E, 0x5F });                   // pop rsi; pop rdi
+        }
+
+        void compare (uint8_t setcc)
+        {
+            emit({ 0x39, 0xC8 });                   // cmp eax, ecx
+            emit({ 0x0F, setcc, 0xC0 });            // setcc al
+            emit({ 0x0F, 0xB6, 0xC0 });             // movzx eax, al
+        }
+
+        // b == 0 -> 0, b == -1 -> -a (div) or 0 (mod), see applyBinary()
+        void divide (bool modulo)
+        {
+            emit({ 0x85, 0xC9 });                   // test ecx, ecx
+            size_t toZero = jump(0x74);             // jz zero
+            emit({ 0x83, 0xF9, 0xFF });             // cmp ecx, -1
+            size_t toDivide = jump(0x75);           // jne divide
+            if (modulo)
+                emit({ 0x31, 0xC0 });               // xor eax, eax
+            else
+                emit({ 0xF7, 0xD8 });               // neg eax
+            size_t toEnd1 = jump(0xEB);             // jmp end
+            land(toDivide);
+            emit({ 0x99 });                         // cdq
+            emit({ 0xF7, 0xF9 });                   // idiv ecx
+            if (modulo)
+                emit({ 0x89, 0xD0 });               // mov eax, edx
+            size_t toEnd2 = jump(0xEB);             // jmp end
+            land(toZero);
+            emit({ 0x31, 0xC0 });                   // xor eax, eax
+            land(toEnd1);
+            land(toEnd2);
+        }
+
+        // eax = index < size ? table[offset + index] : 0
+        void lookup (int32_t arg)
+        {
+            emit({ 0x89, 0xC0 });                           // mov eax, eax (clears the top of rax after a pop)
+            emit({ 0x3D }); emit32(lookupSize(arg));       // cmp eax, size
+            size_t toZero = jump(0x73);                     // jae zero (unsigned, so negative too)
+            emit({ 0x48, 0x8D, 0x0D });                     // lea rcx, [rip + table]
+            tableFixups.push_back({ bytes.size(), lookupOffset(arg) });
+            emit32(0);
+            emit({ 0x8B, 0x04, 0x81 });                     // mov eax, [rcx + rax*4]
+            size_t toEnd = jump(0xEB);                      // jmp end
+            land(toZero);
+            emit({ 0x31, 0xC0 });                           // xor eax, eax
+            land(toEnd);
+        }
+
+        void loadState()
+        {
+            emit({ 0x48, 0x8B, 0x4D, stateSlot });  // mov rcx, [rbp-stateSlot]
+        }
+
+        // eax = state->cells[eax & 15]
+        void cell()
+        {
+            emit({ 0x83, 0xE0, uint8_t(maxCells - 1) });    // and eax, 15 (clears the top of rax too)
+            loadState();
+            emit({ 0x8B, 0x04, 0x81 });                     // mov eax, [rcx + rax*4]
+        }
+
+        bool assemble (const Program& program)
+        {
+            emit({ 0x55 });                         // push rbp
+            emit({ 0x48, 0x89, 0xE5 });             // mov rbp, rsp
+            emit({ 0x48, 0x83, 0xEC, frameSize });  // sub rsp, register slots and state pointer
+            emit({ 0x48, 0x89, 0x55, stateSlot });  // mov [rbp-stateSlot], rdx
+
+            for (int i=0; i<program.length; ++i)
+            {
+                const Instruction ins = program.code[i];
+                const uint8_t slot = uint8_t(int8_t(-4 * (ins.arg + 1)));
+
+                switch (ins.op)
+                {
+                    case OpCode::Const: pushValue(); emit({ 0xB8 }); emit32(ins.arg); break;   // mov eax, imm32
+                    case OpCode::T:     pushValue(); emit({ 0x89, 0xF8 }); break;               // mov eax, edi
+                    case OpCode::X:     pushValue(); emit({ 0x89, 0xF0 }); break;               // mov eax, esi
+                    case OpCode::Load:  pushValue(); emit({ 0x8B, 0x45, slot }); break;         // mov eax, [rbp-slot]
+                    case OpCode::Store: emit({ 0x89, 0x45, slot }); break;                      // mov [rbp-slot], eax
+                    case OpCode::Pop:
+                        if (depth > 1)
+                        {
+                            emit({ 0x58 });                 // pop rax
+                            --pushes;
+                        }
+                        --depth;
+                        break;
+                    case OpCode::Lookup: lookup(ins.arg); break;
+                    case OpCode::Prev:
+                        pushValue();
+                        loadState();
+                        emit({ 0x8B, 0x41, y1Offset });     // mov eax, [rcx + y1]
+                        break;
+                    case OpCode::Cell:  cell(); break;
+                    case OpCode::SetCell:
+                        if (ins.arg < 0 || ins.arg >= maxCells)
+                            return false;
+                        loadState();
+                        emit({ 0x89, 0x41, uint8_t(ins.arg * 4) });    // mov [rcx + cell], eax
+                        break;
+                    case OpCode::Not:   emit({ 0xF7, 0xD0 }); break;                            // not eax
+                    case OpCode::Neg:   emit({ 0xF7, 0xD8 }); break;                            // neg eax
+                    case OpCode::Select:
+                        // eax = else, then below it the then value and the condition
+                        emit({ 0x59, 0x5A });               // pop rcx; pop rdx
+                        pushes -= 2;
+                        depth -= 2;
+                        emit({ 0x85, 0xD2 });               // test edx, edx
+                        emit({ 0x0F, 0x45, 0xC1 });         // cmovnz eax, ecx
+                        break;
+                    case OpCode::Sin:   callHelper(jitSin); break;
+                    case OpCode::Cos:   callHelper(jitCos); break;
+                    default:
+                        popOperands();
+                        switch (ins.op)
+                        {
+                            case OpCode::Add: emit({ 0x01, 0xC8 }); break;        // add eax, ecx
+                            case OpCode::Sub: emit({ 0x29, 0xC8 }); break;        // sub eax, ecx
+                            case OpCode::Mul: emit({ 0x0F, 0xAF, 0xC1 }); break;  // imul eax, ecx
+                            case OpCode::And: emit({ 0x21, 0xC8 }); break;        // and eax, ecx
+                            case OpCode::Or:  emit({ 0x09, 0xC8 }); break;        // or eax, ecx
+                            case OpCode::Xor: emit({ 0x31, 0xC8 }); break;        // xor eax, ecx
+                            case OpCode::Shl: emit({ 0xD3, 0xE0 }); break;        // shl eax, cl (count masked to 5 bits)
+                            case OpCode::Shr: emit({ 0xD3, 0xF8 }); break;        // sar eax, cl
+                            case OpCode::Div: divide(false); break;
+                            case OpCode::Mod: divide(true); break;
+                            case OpCode::Lt:  compare(0x9C); break;               // setl
+                            case OpCode::Gt:  compare(0x9F); break;               // setg
+                            case OpCode::Le:  compare(0x9E); break;               // setle
+                            case OpCode::Ge:  compare(0x9D); break;               // setge
+                            case OpCode::Eq:  compare(0x94); break;               // sete
+                            case OpCode::Ne:  compare(0x95); break;               // setne
+                            default:          return false;
+                        }
+                        break;
+                }
+            }
+
+            if (depth == 0)
+                emit({ 0x31, 0xC0 });               // xor eax, eax
+
+            loadState();
+            emit({ 0x48, 0x85, 0xC9 });             // test rcx, rcx
+            size_t noState = jump(0x74);            // jz done
+            emit({ 0x89, 0x41, y1Offset });         // mov [rcx + y1], eax
+            land(noState);
+
+            emit({ 0x48, 0x89, 0xEC });             // mov rsp, rbp
+            emit({ 0x5D });                         // pop rbp
+            emit({ 0xC3 });                         // ret
+
+            if (program.tableLength > 0)
+            {
+                while (bytes.size() % 4 != 0)
+                    emit({ 0xCC });                 // int3 padding
+                const size_t tableStart = bytes.size();
+                for (int i=0; i<program.tableLength; ++i)
+                    emit32(program.table[i]);
+
+                for (const auto& fixup : tableFixups)
+                {
+                    const int32_t displacement = int32_t(tableStart + size_t(fixup.second) * 4 - (fixup.first + 4));
+                    memcpy(bytes.data() + fixup.first, &displacement, 4);
+                }
+            }
+            return true;
+        }
+    };
+}
+
+unique_ptr<ExprJit> ExprJit::compile (const Program& program)
+{
+    Assembler assembler;
+    if (!assembler.assemble(program))
+        return nullptr;
+
+    const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+    const size_t size = (assembler.bytes.size() + pageSize - 1) / pageSize * pageSize;
+
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return nullptr;
+
+    memcpy(mem, assembler.bytes.data(), assembler.bytes.size());
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(mem, size);
+        return nullptr;
+    }
+    return unique_ptr<ExprJit>(new ExprJit(mem, size));
+}
+
+ExprJit::ExprJit (void* c, size_t size)
+    : code(c), codeSize(size), function(reinterpret_cast<Function>(c))
+{
+}
+
+ExprJit::~ExprJit()
+{
+    munmap(code, codeSize);
+}
+
+#else
+
+unique_ptr<ExprJit> ExprJit::compile (const Program&)
+{
+    return nullptr;
+}
+
+ExprJit::ExprJit (void* c, size_t size)
+    : code(c), codeSize(size), function(nullptr)
+{
+}
+
+ExprJit::~ExprJit()
+{
+}
+
+#endif
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "ExprCompiler.h"
+#include <memory>
+#include <cstddef>
+
+// Native code backend for compiled expressions. Only x86-64 Linux is supported;
+// build with RIBCRUSHER_JIT=0 to leave it out. When compile() returns nullptr
+// callers keep using runProgram()/evaluateBlock(), which give identical results.
+#ifndef RIBCRUSHER_JIT
+ #if defined(__x86_64__) && defined(__linux__)
+  #define RIBCRUSHER_JIT 1
+ #else
+  #define RIBCRUSHER_JIT 0
+ #endif
+#endif
+
+class ExprJit
+{
+public:
+    // state works like runProgram()'s: y1 is set to the result if there is one, and
+    // programs that use y1 or m[] have to be given one
+    using Function = int (*)(uint32_t t, int x, ExprState* state);
+
+    // Emits machine code for the program into its own executable pages.
+    // Allocates and calls mmap, so never call this from the audio thread.
+    static std::unique_ptr<ExprJit> compile(const Program& program);
+    static bool isSupported() { return RIBCRUSHER_JIT != 0; }
+
+    ~ExprJit();
+
+    Function getFunction() const { return function; }
+
+private:
+    ExprJit(void* code, size_t size);
+
+    void*    code;
+    size_t   codeSize;
+    Function function;
+
+    ExprJit(const ExprJit&) = delete;
+    ExprJit& operator=(const ExprJit&) = delete;
+};
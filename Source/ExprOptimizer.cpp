@@ -0,0 +1,336 @@
+#include "ExprOptimizer.h"
+#include <vector>
+#include <map>
+#include <tuple>
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+    // Expression DAG. Nodes are hash-consed, so structurally identical
+    // sub-expressions end up as the same node.
+    struct Node
+    {
+        OpCode  op;
+        int32_t arg;
+        int     a, b, c;    // children, -1 if unused
+    };
+
+    struct Dag
+    {
+        vector<Node> nodes;
+        map<tuple<int,int32_t,int,int,int>, int> lookup;
+
+        int intern (OpCode op, int32_t arg, int a = -1, int b = -1, int c = -1)
+        {
+            auto key = make_tuple(int(op), arg, a, b, c);
+            auto it = lookup.find(key);
+            if (it != lookup.end())
+                return it->second;
+
+            nodes.push_back({op, arg, a, b, c});
+            int id = int(nodes.size()) - 1;
+            lookup[key] = id;
+            return id;
+        }
+
+        bool isConst (int n) const               { return nodes[n].op == OpCode::Const; }
+        bool isConst (int n, int32_t v) const    { return isConst(n) && nodes[n].arg == v; }
+        int  constant (int32_t v)                { return intern(OpCode::Const, v); }
+
+        int unary (OpCode op, int a)
+        {
+            if (isConst(a))
+                return constant(applyUnary(op, nodes[a].arg));
+            if ((op == OpCode::Not || op == OpCode::Neg) && nodes[a].op == op)
+                return nodes[a].a;
+            return intern(op, 0, a);
+        }
+
+        int binary (OpCode op, int a, int b)
+        {
+            if (isConst(a) && isConst(b))
+                return constant(applyBinary(op, nodes[a].arg, nodes[b].arg));
+
+            // shift counts only use the low 5 bits
+            const bool noShift = isConst(b) && (nodes[b].arg & 31) == 0;
+
+            switch (op)
+            {
+                case OpCode::Add:
+                    if (isConst(b, 0)) return a;
+                    if (isConst(a, 0)) return b;
+                    break;
+                case OpCode::Sub:
+                    if (isConst(b, 0)) return a;
+                    if (a == b)        return constant(0);
+                    break;
+                case OpCode::Mul:
+                    if (isConst(b, 1)) return a;
+                    if (isConst(a, 1)) return b;
+                    if (isConst(a, 0) || isConst(b, 0)) return constant(0);
+                    break;
+                case OpCode::Div:
+                    if (isConst(b, 1)) return a;
+                    if (isConst(b, 0) || isConst(a, 0)) return constant(0);
+                    break;
+                case OpCode::Mod:
+                    if (isConst(b, 1) || isConst(b, 0) || isConst(b, -1) || isConst(a, 0)) return constant(0);
+                    break;
+                case OpCode::And:
+                    if (isConst(b, -1)) return a;
+                    if (isConst(a, -1)) return b;
+                    if (isConst(a, 0) || isConst(b, 0)) return constant(0);
+                    if (a == b) return a;
+                    break;
+                case OpCode::Or:
+                    if (isConst(b, 0)) return a;
+                    if (isConst(a, 0)) return b;
+                    if (a == b) return a;
+                    break;
+                case OpCode::Xor:
+                    if (isConst(b, 0)) return a;
+                    if (isConst(a, 0)) return b;
+                    if (a == b) return constant(0);
+                    break;
+                case OpCode::Shl:
+                case OpCode::Shr:
+                    if (noShift) return a;
+                    if (isConst(a, 0)) return constant(0);
+                    break;
+                case OpCode::Lt:
+                case OpCode::Gt:
+                case OpCode::Ne:
+                    if (a == b) return constant(0);
+                    break;
+                case OpCode::Le:
+                case OpCode::Ge:
+                case OpCode::Eq:
+                    if (a == b) return constant(1);
+                    break;
+                default:
+                    break;
+            }
+
+            // canonical operand order, so t+x and x+t share a node
+            const bool commutative = op == OpCode::Add || op == OpCode::Mul || op == OpCode::And
+                                  || op == OpCode::Or  || op == OpCode::Xor || op == OpCode::Eq
+                                  || op == OpCode::Ne;
+            if (commutative && a > b)
+                swap(a, b);
+
+            return intern(op, 0, a, b);
+        }
+
+        int arrayLookup (const Program& program, int32_t arg, int index)
+        {
+            if (isConst(index))
+                return constant(applyLookup(program, arg, nodes[index].arg));
+            return intern(OpCode::Lookup, arg, index);
+        }
+
+        // m[index] as it reads in the program being optimized, with written[k] the node
+        // last assigned to cell k (-1 if it hasn't been): Cell nodes always read the cell
+        // as the call found it, and the new values are only written back at the end
+        int cell (int index, const int* written)
+        {
+            if (isConst(index))
+            {
+                const int k = cellIndex(nodes[index].arg);
+                return written[k] >= 0 ? written[k] : intern(OpCode::Cell, 0, constant(k));
+            }
+
+            int n = intern(OpCode::Cell, 0, index);
+            const int masked = binary(OpCode::And, index, constant(maxCells - 1));
+            for (int k=0; k<maxCells; ++k)
+                if (written[k] >= 0)
+                    n = select(binary(OpCode::Eq, masked, constant(k)), written[k], n);
+            return n;
+        }
+
+        int select (int cond, int a, int b)
+        {
+            if (isConst(cond))
+                return nodes[cond].arg != 0 ? a : b;
+            if (a == b)
+                return a;
+            return intern(OpCode::Select, 0, cond, a, b);
+        }
+    };
+
+    struct Emitter
+    {
+        const Dag&   dag;
+        vector<int>  reg;
+        vector<bool> stored;
+        Program&     out;
+        int          depth = 0;
+        bool         failed = false;
+
+        void push (Instruction ins, int delta)
+        {
+            if (out.length >= maxProgramLength)
+            {
+                failed = true;
+                return;
+            }
+            out.code[out.length++] = ins;
+            depth += delta;
+            out.stackDepth = max(out.stackDepth, depth);
+            if (depth > maxStackDepth)
+                failed = true;
+        }
+
+        void emit (int n)
+        {
+            if (failed)
+                return;
+
+            const Node& node = dag.nodes[n];
+            if (reg[n] >= 0 && stored[n])
+            {
+                push({OpCode::Load, reg[n]}, 1);
+                return;
+            }
+
+            if (node.a >= 0) emit(node.a);
+            if (node.b >= 0) emit(node.b);
+            if (node.c >= 0) emit(node.c);
+            push({node.op, node.arg}, stackEffect(node.op));
+
+            if (reg[n] >= 0)
+            {
+                push({OpCode::Store, reg[n]}, 0);
+                stored[n] = true;
+            }
+        }
+    };
+}
+
+Program optimizeProgram (const Program& program)
+{
+    if (program.length == 0)
+        return program;
+
+    Dag dag;
+    vector<int> stack;
+    int regNode[maxRegisters] = {};
+    int cellNode[maxCells];
+    fill(cellNode, cellNode + maxCells, -1);
+
+    for (int i=0; i<program.length; ++i)
+    {
+        const Instruction ins = program.code[i];
+        switch (ins.op)
+        {
+            case OpCode::Const:
+            case OpCode::T:
+            case OpCode::X:
+            case OpCode::Prev:
+                stack.push_back(dag.intern(ins.op, ins.op == OpCode::Const ? ins.arg : 0));
+                break;
+            case OpCode::Load:
+                stack.push_back(regNode[ins.arg]);
+                break;
+            case OpCode::Store:
+                regNode[ins.arg] = stack.back();
+                break;
+            case OpCode::Pop:
+                // a finished statement, only its variables live on
+                stack.pop_back();
+                break;
+            case OpCode::Lookup:
+                stack.back() = dag.arrayLookup(program, ins.arg, stack.back());
+                break;
+            case OpCode::Cell:
+                stack.back() = dag.cell(stack.back(), cellNode);
+                break;
+            case OpCode::SetCell:
+                cellNode[ins.arg] = stack.back();
+                break;
+            case OpCode::Sin:
+            case OpCode::Cos:
+            case OpCode::Not:
+            case OpCode::Neg:
+                stack.back() = dag.unary(ins.op, stack.back());
+                break;
+            case OpCode::Select:
+            {
+                int b = stack.back(); stack.pop_back();
+                int a = stack.back(); stack.pop_back();
+                stack.back() = dag.select(stack.back(), a, b);
+                break;
+            }
+            default:
+            {
+                int b = stack.back(); stack.pop_back();
+                int a = stack.back();
+                stack.back() = dag.binary(ins.op, a, b);
+                break;
+            }
+        }
+    }
+
+    // Only the top of the stack is the result, anything below it is dead. Cells that
+    // end up with a new value are written after it, leaving them as they were is free.
+    const int root = stack.back();
+    vector<pair<int, int>> cellWrites;      // (cell, node)
+    for (int k=0; k<maxCells; ++k)
+        if (cellNode[k] >= 0 && cellNode[k] != dag.intern(OpCode::Cell, 0, dag.constant(k)))
+            cellWrites.push_back({ k, cellNode[k] });
+
+    // count references from live nodes; children always have smaller ids than their parents
+    vector<int>  uses(dag.nodes.size(), 0);
+    vector<bool> live(dag.nodes.size(), false);
+    // the result and the cell writes count too, so a value used by more than one of
+    // them is kept in a register instead of worked out again
+    live[root] = true;
+    uses[root] = 1;
+    for (const auto& write : cellWrites)
+    {
+        live[write.second] = true;
+        ++uses[write.second];
+    }
+    for (int n=int(dag.nodes.size())-1; n>=0; --n)
+    {
+        if (!live[n])
+            continue;
+        for (int c : { dag.nodes[n].a, dag.nodes[n].b, dag.nodes[n].c })
+            if (c >= 0)
+            {
+                live[c] = true;
+                ++uses[c];
+            }
+    }
+
+    Program optimized;
+    optimized.sourceLength = program.sourceLength;
+    // arrays stay where they are, so Lookup args don't change
+    optimized.tableLength = program.tableLength;
+    copy(program.table, program.table + program.tableLength, optimized.table);
+
+    Emitter emitter { dag, vector<int>(dag.nodes.size(), -1), vector<bool>(dag.nodes.size(), false), optimized };
+    for (int n=0; n<int(dag.nodes.size()) && optimized.numRegisters < maxRegisters; ++n)
+        if (uses[n] > 1 && dag.nodes[n].a >= 0)
+            emitter.reg[n] = optimized.numRegisters++;
+
+    emitter.emit(root);
+
+    // every new value is worked out before the first one is written, as the Cell nodes
+    // in them read what the cells held when the call started
+    for (const auto& write : cellWrites)
+        emitter.emit(write.second);
+    for (auto it = cellWrites.rbegin(); it != cellWrites.rend(); ++it)
+    {
+        emitter.push({OpCode::SetCell, it->first}, 0);
+        emitter.push({OpCode::Pop, 0}, -1);
+    }
+
+    // Don't hand out a broken program if it didn't fit. It can come out longer than it
+    // went in, when m[] is read with a computed index after cells were assigned and every
+    // possible cell has to be picked from, and then the original is the better one.
+    if (emitter.failed || optimized.length > program.length)
+        return program;
+    return optimized;
+}
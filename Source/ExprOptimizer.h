@@ -0,0 +1,14 @@
+#pragma once
+
+#include "ExprCompiler.h"
+
+// Rewrites a compiled program into an equivalent, cheaper one:
+//  - folds constant sub-expressions, e.g. (4|7), 1<<8 or [1,2,3][1]
+//  - drops identities such as x*1, t+0, x|0, x>>0
+//  - computes repeated sub-expressions (t>>11 ...) once and keeps them in registers,
+//    and drops variables and statements the result doesn't depend on
+//  - keeps cell writes (m[k] = ...), moved to the end with only the last value per cell
+// The result gives exactly the same output (and cells) as the input program for every
+// t, x and state.
+// program.sourceLength is kept, so callers can report the op count before/after.
+Program optimizeProgram(const Program& program);
@@ -1,251 +1,607 @@
 #include "ExprParser.h"
-#include <vector>
-#include <string>
-#include <map>
-#include <stack>
-#include <algorithm>
-#include <stdexcept>
-#include <cstdint>
-#include <cmath>
 
 using namespace std;
 
-vector<Token> shuntingYard (const string& expr)
+namespace
 {
-    static map<char,int> prec = {
-        // L = <<, R = >>
-        // A = <=, B = >=
-        {'~', 9}, {'N', 9},
-        {'*', 8}, {'/', 8},{ '%', 8},
-        {'+', 7}, {'-', 7},
-        {'L', 6}, {'R', 6},
-        {'<', 5}, {'>', 5}, {'A', 5}, {'B', 5},
-        {'=', 4}, {'!', 4},
-        {'&', 3},
-        {'^', 2},
-        {'|', 1},
-        {'?', 0}, {':', 0} // TODO
+    struct BinaryOperator
+    {
+        string_view text;
+        char        op;
+        int         precedence;
+    };
+
+    // C precedence, higher binds tighter. Two char spellings first, so "<<" wins over "<".
+    constexpr BinaryOperator binaryOperators[] = {
+        { "<<", 'L', 6 }, { ">>", 'R', 6 },
+        { "<=", 'A', 5 }, { ">=", 'B', 5 },
+        { "==", '=', 4 }, { "!=", '!', 4 },
+        { "*",  '*', 8 }, { "/",  '/', 8 }, { "%", '%', 8 },
+        { "+",  '+', 7 }, { "-",  '-', 7 },
+        { "<",  '<', 5 }, { ">",  '>', 5 },
+        { "&",  '&', 3 },
+        { "^",  '^', 2 },
+        { "|",  '|', 1 }
+    };
+
+    // op= assignments, spelled as the operator plus '='
+    constexpr BinaryOperator compoundAssignments[] = {
+        { "<<", 'L', 0 }, { ">>", 'R', 0 },
+        { "+",  '+', 0 }, { "-",  '-', 0 }, { "*", '*', 0 }, { "/", '/', 0 }, { "%", '%', 0 },
+        { "&",  '&', 0 }, { "|",  '|', 0 }, { "^", '^', 0 }
     };
-    vector<Token>      output;
-    stack<char>        opstack;
 
-    for (size_t i=0; i<expr.size(); ++i)
+    constexpr int ternaryPrecedence = 0;    // below |, and right associative
+    constexpr int maxNesting = 256;         // brackets and unary ops, keeps the recursion bounded
+
+    constexpr bool isDigit (char c)     { return c >= '0' && c <= '9'; }
+    constexpr bool isNameStart (char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+    constexpr bool isNameChar (char c)  { return isNameStart(c) || isDigit(c); }
+    constexpr bool isSpace (char c)     { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+    constexpr int hexDigit (char c)
     {
-        if (expr.substr(i, 3) == "sin") {
-            output.push_back({TokenType::Function, 0, 0, "sin"});
-            i += 2;
-            continue;
-        }
-        else if (expr.substr(i, 3) == "cos") {
-            output.push_back({TokenType::Function, 0, 0, "cos"});
-            i += 2;
-            continue;
-        }
-        char c = expr[i];
+        return isDigit(c) ? c - '0'
+             : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+             : (c >= 'A' && c <= 'F') ? c - 'A' + 10
+             : -1;
+    }
 
-        if (i+1 < expr.size())
+    // Precedence climbing, writing tokens out as soon as their operands are done
+    class Parser
+    {
+    public:
+        Parser (string_view t, Token* o, int cap) : text(t), out(o), capacity(cap) {}
+
+        ParseResult run (int& numTokens)
         {
-            if (expr.substr(i,2) == "<=") {
-                char op = 'A';
-                while (!opstack.empty() && opstack.top() != '(' && prec.at(opstack.top()) >= prec.at(op))
+            skipSpace();
+            if (pos < text.size() && parseStatements())
+            {
+                skipSpace();
+                if (pos < text.size())
                 {
-                    output.push_back({TokenType::Operator,0,opstack.top()});
-                    opstack.pop();
+                    const char c = text[pos];
+                    fail(c == ')' ? ParseError::UnmatchedCloseParen
+                                  : (isNameStart(c) || isDigit(c) || c == '(' || c == '[' || c == '~') ? ParseError::ExpectedOperator
+                                                                                                          : ParseError::UnexpectedCharacter, pos);
                 }
-                opstack.push(op);
-                ++i;
-                continue;
             }
-            if (expr.substr(i,2) == ">=") {
-                char op = 'B';
-                while (!opstack.empty() && opstack.top() != '(' && prec.at(opstack.top()) >= prec.at(op))
-                {
-                    output.push_back({TokenType::Operator,0,opstack.top()});
-                    opstack.pop();
-                }
-                opstack.push(op);
-                ++i;
-                continue;
+            numTokens = result.ok() ? count : 0;
+            return result;
+        }
+
+    private:
+        string_view text;
+        size_t      pos = 0;
+        Token*      out;
+        int         capacity;
+        int         count = 0;
+        int         nesting = 0;
+        ParseResult result;
+
+        // names seen so far, pointing into text
+        string_view variables[maxVariables];
+        int         numVariables = 0;
+        struct NamedArray { string_view name; int index; };
+        NamedArray  namedArrays[maxArrays];
+        int         numNamedArrays = 0;
+        int         numArrays = 0;
+        int         numElements = 0;
+
+        bool fail (ParseError error, size_t at)
+        {
+            if (result.ok())
+                result = { error, int(at) };
+            return false;
+        }
+
+        bool emit (TokenType type, int value, char op, size_t at)
+        {
+            if (count >= capacity)
+                return fail(ParseError::TooLong, at);
+            out[count++] = { type, value, op, int(at) };
+            return true;
+        }
+
+        void skipSpace()
+        {
+            while (pos < text.size() && isSpace(text[pos]))
+                ++pos;
+        }
+
+        const BinaryOperator* peekBinary() const
+        {
+            const string_view rest = text.substr(pos);
+            for (const auto& b : binaryOperators)
+                if (rest.substr(0, b.text.size()) == b.text)
+                    return &b;
+            return nullptr;
+        }
+
+        int findVariable (string_view name) const
+        {
+            for (int i=0; i<numVariables; ++i)
+                if (variables[i] == name)
+                    return i;
+            return -1;
+        }
+
+        int findArray (string_view name) const
+        {
+            for (int i=0; i<numNamedArrays; ++i)
+                if (namedArrays[i].name == name)
+                    return i;
+            return -1;
+        }
+
+        static bool isBuiltIn (string_view name)
+        {
+            return name == "t" || name == "x" || name == "sin" || name == "cos" || name == "y1" || name == "m";
+        }
+
+        // statement, statement, ... the last one has to give the value
+        bool parseStatements()
+        {
+            for (;;)
+            {
+                bool givesValue = true;
+                if (! parseStatement(givesValue))
+                    return false;
+
+                skipSpace();
+                if (pos >= text.size() || text[pos] != ',')
+                    return givesValue || fail(ParseError::NoResult, pos);
+
+                if (givesValue && ! emit(TokenType::Pop, 0, ',', pos))
+                    return false;
+                ++pos;
+                skipSpace();
+            }
+        }
+
+        // name = value, name op= value, name = [array] or just an expression
+        bool parseStatement (bool& givesValue)
+        {
+            givesValue = true;
+            skipSpace();
+            const size_t start = pos;
+            if (pos >= text.size() || ! isNameStart(text[pos]))
+                return parseExpression(ternaryPrecedence);
+
+            while (pos < text.size() && isNameChar(text[pos]))
+                ++pos;
+            const string_view name = text.substr(start, pos - start);
+            skipSpace();
+            if (name == "m")
+                return parseCellStatement(start);
+
+            bool plain = false;
+            const BinaryOperator* compound = nullptr;
+            if (! peekAssignment(plain, compound))
+            {
+                // not an assignment after all, read it again as an expression
+                pos = start;
+                return parseExpression(ternaryPrecedence);
             }
-            if (expr.substr(i,2) == "==") {
-                char op = '=';
-                while (!opstack.empty() && opstack.top() != '(' && prec.at(opstack.top()) >= prec.at(op))
+
+            if (isBuiltIn(name))
+                return fail(ParseError::NotAssignable, start);
+
+            if (plain)
+            {
+                skipSpace();
+                if (pos < text.size() && text[pos] == '[' && ! isIndexedArray())
                 {
-                    output.push_back({TokenType::Operator,0,opstack.top()});
-                    opstack.pop();
+                    givesValue = false;
+                    return defineArray(name, start);
                 }
-                opstack.push(op);
-                ++i;
-                continue;
+
+                return parseChained(start) && store(name, start);
             }
-            if (expr.substr(i,2) == "!=") {
-                char op = '!';
-                while (!opstack.empty() && opstack.top() != '(' && prec.at(opstack.top()) >= prec.at(op))
+
+            const int variable = findVariable(name);
+            if (variable < 0)
+                return fail(ParseError::UnknownName, start);
+            if (! emit(TokenType::Load, variable, 0, start) || ! parseExpression(ternaryPrecedence))
+                return false;
+            return emit(TokenType::Operator, 0, compound->op, start) && emit(TokenType::Store, variable, 0, start);
+        }
+
+        // [1,2,3][t&3] at pos: an inline array that's indexed right away is a value,
+        // only a bare one after name = defines a named array. Arrays hold only numbers,
+        // so the first ] closes it.
+        bool isIndexedArray() const
+        {
+            size_t at = text.find(']', pos);
+            if (at == string_view::npos)
+                return false;
+            ++at;
+            while (at < text.size() && isSpace(text[at]))
+                ++at;
+            return at < text.size() && text[at] == '[';
+        }
+
+        // = or op= at pos (but not ==), which is skipped
+        bool peekAssignment (bool& plain, const BinaryOperator*& compound)
+        {
+            const string_view rest = text.substr(pos);
+            compound = nullptr;
+            for (const auto& c : compoundAssignments)
+                if (rest.size() > c.text.size() && rest.substr(0, c.text.size()) == c.text && rest[c.text.size()] == '=')
+                    compound = &c;
+
+            plain = rest.size() > 0 && rest[0] == '=' && (rest.size() < 2 || rest[1] != '=');
+            if (! plain && compound == nullptr)
+                return false;
+            pos += plain ? 1 : compound->text.size() + 1;
+            return true;
+        }
+
+        // the value of a = b = value, kept bounded like brackets
+        bool parseChained (size_t start)
+        {
+            if (++nesting > maxNesting)
+                return fail(ParseError::TooDeep, start);
+            bool valueGiven = true;
+            if (! parseStatement(valueGiven))
+                return false;
+            if (! valueGiven)
+                return fail(ParseError::NoResult, pos);
+            --nesting;
+            return true;
+        }
+
+        // m[number] = value, m[number] op= value or an expression starting with m[...],
+        // pos is just past the m
+        bool parseCellStatement (size_t start)
+        {
+            bool plain = false;
+            const BinaryOperator* compound = nullptr;
+            int cell = -1;
+            if (pos >= text.size() || text[pos] != '[')
+            {
+                if (peekAssignment(plain, compound))
+                    return fail(ParseError::NotAssignable, start);
+            }
+            else
+            {
+                ++pos;
+                skipSpace();
+                uint32_t value = 0;
+                if (pos < text.size() && isDigit(text[pos]))
                 {
-                    output.push_back({TokenType::Operator,0,opstack.top()});
-                    opstack.pop();
+                    if (! readNumber(value))
+                        return false;
+                    skipSpace();
+                    if (pos < text.size() && text[pos] == ']')
+                    {
+                        ++pos;
+                        skipSpace();
+                        cell = value < uint32_t(maxCells) ? int(value) : maxCells;
+                    }
                 }
-                opstack.push(op);
-                ++i;
-                continue;
             }
+
+            if (cell < 0 || ! peekAssignment(plain, compound))
+            {
+                pos = start;
+                if (! parseExpression(ternaryPrecedence))
+                    return false;
+                // m[t&3] = ... would otherwise stop at the = with a vaguer message
+                skipSpace();
+                if (pos < text.size() && text[pos] == '=' && (pos + 1 >= text.size() || text[pos + 1] != '='))
+                    return fail(ParseError::BadCellIndex, start);
+                return true;
+            }
+            if (cell >= maxCells)
+                return fail(ParseError::BadCellIndex, start);
+
+            if (plain)
+                return parseChained(start) && emit(TokenType::SetCell, cell, 0, start);
+
+            return emit(TokenType::Number, cell, 0, start) && emit(TokenType::Cell, 0, 0, start)
+                && parseExpression(ternaryPrecedence)
+                && emit(TokenType::Operator, 0, compound->op, start) && emit(TokenType::SetCell, cell, 0, start);
+        }
+
+        // the value on the stack goes into variable name, which is new or a variable already
+        bool store (string_view name, size_t at)
+        {
+            if (findArray(name) >= 0)
+                return fail(ParseError::NotAssignable, at);
+
+            int variable = findVariable(name);
+            if (variable < 0)
+            {
+                if (numVariables >= maxVariables)
+                    return fail(ParseError::TooManyVariables, at);
+                variable = numVariables;
+                variables[numVariables++] = name;
+            }
+            return emit(TokenType::Store, variable, 0, at);
         }
 
-        // bit shifts:
-        if (i+1 < expr.size() && expr[i+1] == c && (c == '<' || c == '>'))
+        bool defineArray (string_view name, size_t at)
         {
-            char shiftOp;
-            if (c == '<')
-                shiftOp = 'L';
-            else
-                shiftOp = 'R'; 
-            while (!opstack.empty() && opstack.top() != '(' && prec.at(opstack.top()) >= prec.at(shiftOp))
+            if (findVariable(name) >= 0)
+                return fail(ParseError::NotAssignable, at);
+
+            int index = -1;
+            if (! parseArray(index))
+                return false;
+
+            // a new array under an old name replaces it
+            int named = findArray(name);
+            if (named < 0)
             {
-                output.push_back({TokenType::Operator,0,opstack.top()});
-                opstack.pop();
+                if (numNamedArrays >= maxArrays)
+                    return fail(ParseError::ArraysTooLarge, at);
+                named = numNamedArrays++;
             }
-            opstack.push(shiftOp);
-            ++i;
-            continue;
+            namedArrays[named] = { name, index };
+            return true;
         }
 
-        if (c == 't')
+        // [number, number, ...], pos is on the '['
+        bool parseArray (int& index)
         {
-            output.push_back({TokenType::Variable, 0, 't'});
+            const size_t open = pos++;
+            if (numArrays >= maxArrays)
+                return fail(ParseError::ArraysTooLarge, open);
+
+            int numValues = 0;
+            for (;;)
+            {
+                skipSpace();
+                bool negative = false;
+                if (pos < text.size() && (text[pos] == '-' || text[pos] == '+'))
+                {
+                    negative = text[pos++] == '-';
+                    skipSpace();
+                }
+
+                const size_t at = pos;
+                uint32_t value = 0;
+                if (pos >= text.size() || ! isDigit(text[pos]))
+                    return fail(ParseError::ExpectedNumber, pos);
+                if (! readNumber(value))
+                    return false;
+                if (numElements >= maxArrayElements)
+                    return fail(ParseError::ArraysTooLarge, open);
+                if (! emit(TokenType::Element, int(negative ? 0u - value : value), 0, at))
+                    return false;
+                ++numElements;
+                ++numValues;
+
+                skipSpace();
+                if (pos < text.size() && text[pos] == ',')
+                {
+                    ++pos;
+                    continue;
+                }
+                if (pos >= text.size() || text[pos] != ']')
+                    return fail(ParseError::MissingCloseBracket, open);
+                ++pos;
+                break;
+            }
+
+            index = numArrays++;
+            return emit(TokenType::Array, numValues, 0, open);
         }
-        else if (c == 'x')
+
+        // [index] after an array or m, pos is on the '['
+        bool parseIndex (TokenType type, int value)
         {
-            output.push_back({TokenType::Input, 0, 'x'});
+            const size_t open = pos++;
+            if (! parseExpression(ternaryPrecedence))
+                return false;
+            skipSpace();
+            if (pos >= text.size() || text[pos] != ']')
+                return fail(ParseError::MissingCloseBracket, open);
+            ++pos;
+            return emit(type, value, 0, open);
         }
-        else if (isdigit(c))
+
+        bool expectIndex (TokenType type, int value)
         {
-            // handle multi-digit integers
-            size_t start = i;
-            while (i < expr.size() && isdigit(expr[i]))
-                ++i;
-            std::string numStr = expr.substr(start, i - start);
-            int v = std::stoi(numStr);
-            output.push_back({TokenType::Number, v, 0});
-            --i;
+            skipSpace();
+            if (pos >= text.size() || text[pos] != '[')
+                return fail(ParseError::ExpectedOpenBracket, pos);
+            return parseIndex(type, value);
         }
-        else if (prec.count(c))
+
+        bool parseExpression (int minPrecedence)
         {
-            while (!opstack.empty() && opstack.top() != '(' && prec.at(opstack.top()) >= prec.at(c))
+            if (++nesting > maxNesting)
+                return fail(ParseError::TooDeep, pos);
+            if (! parseUnary())
+                return false;
+
+            for (;;)
             {
-                output.push_back({TokenType::Operator,0,opstack.top()});
-                opstack.pop();
+                skipSpace();
+                if (pos < text.size() && text[pos] == '?' && minPrecedence <= ternaryPrecedence)
+                {
+                    const size_t question = pos++;
+                    if (! parseExpression(ternaryPrecedence))
+                        return false;
+                    skipSpace();
+                    if (pos >= text.size() || text[pos] != ':')
+                        return fail(ParseError::ExpectedColon, pos);
+                    ++pos;
+                    if (! parseExpression(ternaryPrecedence) || ! emit(TokenType::Operator, 0, '?', question))
+                        return false;
+                    continue;
+                }
+
+                const BinaryOperator* b = peekBinary();
+                if (b == nullptr || b->precedence < minPrecedence)
+                    break;
+
+                const size_t at = pos;
+                pos += b->text.size();
+                // left associative: the right operand only takes tighter operators
+                if (! parseExpression(b->precedence + 1) || ! emit(TokenType::Operator, 0, b->op, at))
+                    return false;
             }
-            opstack.push(c);
+
+            --nesting;
+            return true;
         }
-        else if (c == '(')
+
+        bool parseUnary()
         {
-            opstack.push(c);
+            skipSpace();
+            if (pos < text.size() && (text[pos] == '~' || text[pos] == '-' || text[pos] == '+'))
+            {
+                const size_t at = pos;
+                const char c = text[pos++];
+                if (++nesting > maxNesting)
+                    return fail(ParseError::TooDeep, at);
+                if (! parseUnary())
+                    return false;
+                --nesting;
+                return c == '+' || emit(TokenType::Operator, 0, c == '~' ? '~' : 'N', at);
+            }
+            return parsePrimary();
         }
-        else if (c == ')')
+
+        bool parsePrimary()
         {
-            while (!opstack.empty() && opstack.top() != '(')
+            if (pos >= text.size())
+                return fail(ParseError::ExpectedOperand, pos);
+
+            const size_t start = pos;
+            const char c = text[pos];
+
+            if (isDigit(c))
+                return parseNumber();
+
+            if (isNameStart(c))
+            {
+                while (pos < text.size() && isNameChar(text[pos]))
+                    ++pos;
+                const string_view name = text.substr(start, pos - start);
+
+                if (name == "t")  return emit(TokenType::Variable, 0, 't', start);
+                if (name == "x")  return emit(TokenType::Input, 0, 'x', start);
+                if (name == "y1") return emit(TokenType::Previous, 0, 0, start);
+                if (name == "m")  return expectIndex(TokenType::Cell, 0);
+                if (name == "sin" || name == "cos")
+                {
+                    skipSpace();
+                    if (pos >= text.size() || text[pos] != '(')
+                        return fail(ParseError::ExpectedOpenParen, pos);
+                    return parseBracketed() && emit(TokenType::Function, 0, name[0], start);
+                }
+
+                if (const int variable = findVariable(name); variable >= 0)
+                    return emit(TokenType::Load, variable, 0, start);
+                if (const int named = findArray(name); named >= 0)
+                    return expectIndex(TokenType::Lookup, namedArrays[named].index);
+                return fail(ParseError::UnknownName, start);
+            }
+
+            if (c == '(')
+                return parseBracketed();
+
+            if (c == '[')
             {
-                output.push_back({TokenType::Operator,0,opstack.top()});
-                opstack.pop();
+                int index = -1;
+                return parseArray(index) && expectIndex(TokenType::Lookup, index);
             }
-            if (opstack.empty())
-                throw runtime_error("Mismatched ')'");
-            opstack.pop();
+
+            if (string_view("*/%&|^<>=!?:),]").find(c) != string_view::npos)
+                return fail(ParseError::ExpectedOperand, pos);
+            return fail(ParseError::UnexpectedCharacter, pos);
         }
-        else if (c == ' ')
+
+        // ( expression ), pos is on the '('
+        bool parseBracketed()
         {
-            continue;
+            const size_t open = pos++;
+            if (! parseExpression(ternaryPrecedence))
+                return false;
+            skipSpace();
+            if (pos >= text.size() || text[pos] != ')')
+                return fail(ParseError::MissingCloseParen, open);
+            ++pos;
+            return true;
         }
-        else
+
+        bool parseNumber()
         {
-            throw runtime_error(string("Invalid char: ")+c);
+            const size_t start = pos;
+            uint32_t value = 0;
+            return readNumber(value) && emit(TokenType::Number, int(value), 0, start);
         }
-    }
 
-    while (!opstack.empty())
-    {
-        if (opstack.top()=='(' || opstack.top()==')')
-            throw runtime_error("Mismatched brackets");
-        output.push_back({TokenType::Operator,0,opstack.top()});
-        opstack.pop();
-    }
-    return output;
-}
-
-int evaluateExpr(const vector<Token>& tokens, uint32_t t, int x)
-{
-    vector<int> stack;
-    for (const auto& token : tokens)
-    {
-        switch (token.type)
+        // decimal or 0x hex, anything up to 0xFFFFFFFF (bigger values used to be an error too)
+        bool readNumber (uint32_t& number)
         {
-            case TokenType::Number:
-                stack.push_back(token.value);
-                break;
-            case TokenType::Variable:
-                stack.push_back(static_cast<int>(t));
-                break;
-            case TokenType::Input:
-                stack.push_back(x);
-                break;
-            case TokenType::Function: {
-                if (stack.empty()) return 0;
-                int arg = stack.back();
-                stack.pop_back();
-                if (token.func == "sin")
-                    stack.push_back(static_cast<int>(127.5f * (std::sin(arg) + 1.0f)));
-                else if (token.func == "cos")
-                    stack.push_back(static_cast<int>(127.5f * (std::cos(arg) + 1.0f)));
-                break;
-            }
-            case TokenType::Operator: {
-                // unary
-                if (token.op == '~') {
-                    if (stack.empty()) return 0;
-                    int b = stack.back();
-                    stack.pop_back();
-                    stack.push_back(~b);
-                    break;
+            const size_t start = pos;
+            uint64_t value = 0;
+
+            const string_view prefix = text.substr(pos, 2);
+            if ((prefix == "0x" || prefix == "0X") && pos + 2 < text.size() && hexDigit(text[pos + 2]) >= 0)
+            {
+                pos += 2;
+                while (pos < text.size() && hexDigit(text[pos]) >= 0)
+                {
+                    value = value * 16 + uint64_t(hexDigit(text[pos++]));
+                    if (value > 0xFFFFFFFFu)
+                        return fail(ParseError::NumberTooLarge, start);
                 }
-                // binary
-                if (stack.size() < 2) return 0;
-                int b = stack.back(); stack.pop_back();
-                int a = stack.back(); stack.pop_back();
-                switch (token.op) {
-                    case '+': stack.push_back(a + b); break;
-                    case '-': stack.push_back(a - b); break;
-                    case '*': stack.push_back(a * b); break;
-                    case '/':
-                        if (b != 0)
-                            stack.push_back(a / b);
-                        else
-                            stack.push_back(0);
-                        break;
-                    case '%':
-                        if (b != 0)
-                            stack.push_back(a % b);
-                        else
-                            stack.push_back(0);
-                        break;
-                    case '&': stack.push_back(a & b); break;
-                    case '|': stack.push_back(a | b); break;
-                    case '^': stack.push_back(a ^ b); break;
-                    case 'L': stack.push_back(a << b); break;
-                    case 'R': stack.push_back(a >> b); break;
-                    case '<': stack.push_back(a < b); break;
-                    case '>': stack.push_back(a > b); break;
-                    case 'A': stack.push_back(a <= b); break;
-                    case 'B': stack.push_back(a >= b); break;
-                    case '=': stack.push_back(a == b); break;
-                    case '!': stack.push_back(a != b); break;
+            }
+            else
+            {
+                while (pos < text.size() && isDigit(text[pos]))
+                {
+                    value = value * 10 + uint64_t(text[pos++] - '0');
+                    if (value > 0xFFFFFFFFu)
+                        return fail(ParseError::NumberTooLarge, start);
                 }
-                break;
             }
-            default: break;
+
+            if (pos < text.size() && isNameChar(text[pos]))
+                return fail(ParseError::UnexpectedCharacter, pos);
+            number = uint32_t(value);
+            return true;
         }
+    };
+}
+
+const char* parseErrorMessage (ParseError error)
+{
+    switch (error)
+    {
+        case ParseError::None:                return "";
+        case ParseError::UnexpectedCharacter: return "Unexpected character";
+        case ParseError::UnknownName:         return "Unknown name, use t, x, y1, m[], sin(), cos() or a variable assigned before";
+        case ParseError::ExpectedOperand:     return "Expected a number, a name or (";
+        case ParseError::ExpectedOperator:    return "Expected an operator";
+        case ParseError::ExpectedOpenParen:   return "Expected ( after function name";
+        case ParseError::MissingCloseParen:   return "Missing )";
+        case ParseError::UnmatchedCloseParen: return "Unmatched )";
+        case ParseError::ExpectedColon:       return "Expected : for ?";
+        case ParseError::NumberTooLarge:      return "Number too large";
+        case ParseError::TooLong:             return "Expression too long";
+        case ParseError::TooDeep:             return "Expression nested too deeply";
+        case ParseError::NotAssignable:       return "Can't assign to this name";
+        case ParseError::TooManyVariables:    return "Too many variables";
+        case ParseError::ArraysTooLarge:      return "Too many or too long arrays";
+        case ParseError::ExpectedNumber:      return "Array elements have to be numbers";
+        case ParseError::ExpectedOpenBracket: return "Expected [ after array";
+        case ParseError::MissingCloseBracket: return "Missing ]";
+        case ParseError::NoResult:            return "The last statement has to give a value";
+        case ParseError::BadCellIndex:        return "Assign to m[0] to m[15], with a plain number";
     }
-    if (stack.empty())
-        return 0;
-    else
-        return stack.back();
+    return "";
+}
+
+ParseResult parseExpr (string_view expr, Token* out, int capacity, int& numTokens)
+{
+    Parser parser (expr, out, capacity);
+    return parser.run(numTokens);
 }
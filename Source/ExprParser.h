@@ -2,19 +2,87 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include <cstdint>
 
 using namespace std;
 
-enum class TokenType { Number, Variable, Input, Operator, Function };
+enum class TokenType { Number, Variable, Input, Operator, Function,
+                       Load, Store, Pop, Element, Array, Lookup,
+                       Previous, Cell, SetCell };
 
+// One step of an expression in reverse Polish notation.
+// Operators use one char each: L = <<, R = >>, A = <=, B = >=, = is ==, ! is !=,
+// N = unary minus, ? = the ternary (cond, then, else). Functions: s = sin, c = cos.
+// Load/Store read and write user variable number value (Store leaves the value on
+// the stack), Pop drops the value of a finished statement. A constant array is its
+// Element tokens followed by an Array token (value = element count), and takes the
+// next array number; Lookup (value = array number) replaces an index with its element.
+// Previous is y1, the formula's own result on the sample before. Cell replaces an index
+// with that memory cell (m[index]), SetCell writes the top to cell number value and
+// leaves it on the stack, like Store.
 struct Token
 {
     TokenType type;
-    int        value;
-    char       op;
-    string func;
+    int       value;
+    char      op;
+    int       offset;   // where it starts in the source text
 };
 
-vector<Token> shuntingYard(const string& expr);
-int evaluateExpr(const vector<Token>& tokens, uint32_t t, int x);
+enum class ParseError : uint8_t
+{
+    None,
+    UnexpectedCharacter,
+    UnknownName,
+    ExpectedOperand,
+    ExpectedOperator,
+    ExpectedOpenParen,
+    MissingCloseParen,
+    UnmatchedCloseParen,
+    ExpectedColon,
+    NumberTooLarge,
+    TooLong,
+    TooDeep,
+    NotAssignable,
+    TooManyVariables,
+    ArraysTooLarge,
+    ExpectedNumber,
+    ExpectedOpenBracket,
+    MissingCloseBracket,
+    NoResult,
+    BadCellIndex
+};
+
+// Limits of the language, so every formula compiles to a program of fixed size
+constexpr int maxVariables     = 16;    // named values, one register each
+constexpr int maxArrays        = 16;    // constant arrays
+constexpr int maxArrayElements = 256;   // in all of them together
+constexpr int maxCells         = 16;    // m[0] to m[15], kept from one sample to the next
+
+struct ParseResult
+{
+    ParseError error  = ParseError::None;
+    int        offset = 0;      // character the error points at
+
+    bool ok() const { return error == ParseError::None; }
+};
+
+const char* parseErrorMessage(ParseError error);
+
+// Parses expr straight into RPN tokens in out (room for capacity of them) and sets
+// numTokens. Doesn't allocate or throw, so it's cheap enough to run on every keystroke.
+// An empty (or blank) expression gives no tokens, which plays as silence.
+//
+// A formula is statements separated by commas, the last one gives the result:
+//   a=t>>8, b=a&3, n=[3,5,8,5], t*n[b]>>(a&7)
+// Statements can assign a variable (=, +=, -=, *=, /=, %=, &=, |=, ^=, <<=, >>=)
+// or name a constant array. Assignments are only allowed as statements, not inside
+// expressions, and variables have to be assigned before they're read. Arrays hold
+// integers only and read 0 past either end; [1,2,3][t>>12&3] works inline too.
+//
+// y1 is the formula's result on the sample before, and m[0] to m[15] are memory cells
+// that keep their value from one sample to the next, for feedback and filters:
+//   m[0] += (t*3&255) - m[0] >> 3, m[0]
+// Both start at 0. Cells are assigned like variables, with a plain number as the
+// index; reading takes any expression, wrapped to 0..15.
+ParseResult parseExpr(string_view expr, Token* out, int capacity, int& numTokens);
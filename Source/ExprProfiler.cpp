@@ -0,0 +1,112 @@
+#include "ExprProfiler.h"
+
+ExprProfiler::ExprProfiler (std::function<void (const Result&)> onResult)
+    : juce::Thread ("RibCrusher profiler"), callback(std::move(onResult))
+{
+    startThread();
+}
+
+ExprProfiler::~ExprProfiler()
+{
+    stopThread(1000);
+    cancelPendingUpdate();
+}
+
+void ExprProfiler::profile (const juce::String& text, bool useJit)
+{
+    {
+        const juce::ScopedLock sl (lock);
+        pendingText = text;
+        pendingJit = useJit;
+        hasPending = true;
+    }
+    notify();
+}
+
+double ExprProfiler::measure (const CompiledExpr& expr, bool useJit, const juce::Thread* thread)
+{
+    // the same chunks crushHolds() evaluates in
+    constexpr int chunk = 256;
+    int x[chunk], out[chunk];
+    juce::Random random (1);
+    for (auto& v : x)
+        v = random.nextInt(256);
+
+    const auto fn = (useJit && expr.jit != nullptr) ? expr.jit->getFunction() : nullptr;
+    const auto budget = juce::Time::secondsToHighResolutionTicks(measureSeconds);
+    const auto start = juce::Time::getHighResolutionTicks();
+
+    uint32_t t = 0;
+    int sink = 0;
+    ExprState state;
+    juce::int64 elapsed = 0;
+    do
+    {
+        if (fn != nullptr)
+        {
+            for (int i=0; i<chunk; ++i)
+                out[i] = fn(t + uint32_t(i), x[i], &state);
+        }
+        else if (expr.stateful)
+        {
+            for (int i=0; i<chunk; ++i)
+                out[i] = runProgram(expr.program, t + uint32_t(i), x[i], &state);
+        }
+        else
+        {
+            evaluateBlock(expr.program, t, x, out, chunk);
+        }
+        sink ^= out[chunk - 1];
+        t += chunk;
+        elapsed = juce::Time::getHighResolutionTicks() - start;
+    }
+    while (elapsed < budget && (thread == nullptr || ! thread->threadShouldExit()));
+
+    juce::ignoreUnused(sink);
+    return juce::Time::highResolutionTicksToSeconds(elapsed) * 1.0e9 / double(t);
+}
+
+void ExprProfiler::run()
+{
+    while (! threadShouldExit())
+    {
+        wait(-1);
+
+        for (;;)
+        {
+            Result result;
+            bool useJit = true;
+            {
+                const juce::ScopedLock sl (lock);
+                if (! hasPending)
+                    break;
+                result.text = pendingText;
+                useJit = pendingJit;
+                hasPending = false;
+            }
+            if (threadShouldExit())
+                return;
+
+            result.expr = exprCache->get(result.text.toStdString(), result.parse);
+            if (result.expr != nullptr)
+                result.nanosPerEvaluation = measure(*result.expr, useJit, this);
+
+            {
+                const juce::ScopedLock sl (lock);
+                finished = result;
+            }
+            triggerAsyncUpdate();
+        }
+    }
+}
+
+void ExprProfiler::handleAsyncUpdate()
+{
+    Result result;
+    {
+        const juce::ScopedLock sl (lock);
+        std::swap(result, finished);
+    }
+    if (result.text.isNotEmpty() || result.expr != nullptr)
+        callback(result);
+}
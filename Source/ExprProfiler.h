@@ -0,0 +1,51 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "ExprCache.h"
+#include <functional>
+
+// Compiles formulas typed into the editor and times them on a worker thread, so
+// the editor can show what one costs (and turn it down) before processBlock ever
+// runs it. Only the newest request counts: text typed while one is being timed
+// replaces whatever was still waiting.
+class ExprProfiler  : private juce::Thread,
+                      private juce::AsyncUpdater
+{
+public:
+    struct Result
+    {
+        juce::String      text;
+        ParseResult       parse;
+        CompiledExpr::Ptr expr;             // null if it didn't parse
+        double            nanosPerEvaluation = 0.0;
+    };
+
+    // onResult is called on the message thread
+    explicit ExprProfiler (std::function<void (const Result&)> onResult);
+    ~ExprProfiler() override;
+
+    // Message thread
+    void profile (const juce::String& text, bool useJit);
+
+    // How long each formula is run for
+    static constexpr double measureSeconds = 0.004;
+
+    // Runs expr with the backend processBlock would use over synthetic t/x for
+    // about measureSeconds, returns the average cost of one evaluation
+    static double measure (const CompiledExpr& expr, bool useJit, const juce::Thread* thread = nullptr);
+
+private:
+    void run() override;
+    void handleAsyncUpdate() override;
+
+    std::function<void (const Result&)> callback;
+    juce::SharedResourcePointer<ExprCache> exprCache;
+
+    juce::CriticalSection lock;
+    juce::String pendingText;
+    bool hasPending = false;
+    bool pendingJit = true;
+    Result finished;            // under lock, handed to the message thread
+
+    JUCE_DECLARE_NON_COPYABLE (ExprProfiler)
+};
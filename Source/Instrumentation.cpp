@@ -0,0 +1,37 @@
+#include "Instrumentation.h"
+
+#if RIBCRUSHER_INSTRUMENTATION
+
+void BlockInstrumentation::push (BlockStats stats) noexcept
+{
+    const double deadline = stats.numSamples / sampleRate;
+    stats.deadlineUsed = deadline > 0.0 ? float(stats.seconds / deadline) : 0.0f;
+
+    if (resetRequested.exchange(false, std::memory_order_relaxed))
+    {
+        worstDeadline.store(0.0f, std::memory_order_relaxed);
+        worstSeconds.store(0.0, std::memory_order_relaxed);
+    }
+    // only this thread writes them, so no compare-exchange needed
+    if (stats.deadlineUsed > worstDeadline.load(std::memory_order_relaxed))
+        worstDeadline.store(stats.deadlineUsed, std::memory_order_relaxed);
+    if (stats.seconds > worstSeconds.load(std::memory_order_relaxed))
+        worstSeconds.store(stats.seconds, std::memory_order_relaxed);
+
+    // drop the block rather than wait when the reader falls behind
+    const auto scope = fifo.write(1);
+    if (scope.blockSize1 > 0)
+        ring[size_t(scope.startIndex1)] = stats;
+    else
+        numDropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+int BlockInstrumentation::pop (BlockStats* dest, int maxCount)
+{
+    const auto scope = fifo.read(juce::jmin(maxCount, fifo.getNumReady()));
+    int count = 0;
+    scope.forEach([&] (int index) { dest[count++] = ring[size_t(index)]; });
+    return count;
+}
+
+#endif
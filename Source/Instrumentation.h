@@ -0,0 +1,129 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Per-block timing of processBlock, so an overloaded session can be traced back
+// (or not) to this plugin. Build with RIBCRUSHER_INSTRUMENTATION=0 to compile it
+// out: BlockInstrumentation then keeps its interface but every call is an empty
+// inline function, so processBlock does no extra work at all.
+#ifndef RIBCRUSHER_INSTRUMENTATION
+ #define RIBCRUSHER_INSTRUMENTATION 1
+#endif
+
+#if RIBCRUSHER_INSTRUMENTATION && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+ #if defined(_MSC_VER)
+  #include <intrin.h>
+ #else
+  #include <x86intrin.h>
+ #endif
+#endif
+
+struct BlockStats
+{
+    uint64_t cycles       = 0;      // cycle counter ticks (TSC on x86), not comparable across machines
+    double   seconds      = 0.0;    // wall time spent in processBlock
+    float    deadlineUsed = 0.0f;   // seconds / (numSamples / sampleRate), above 1 is an overrun
+    int      numSamples   = 0;
+    int      evaluations  = 0;      // times the expression was run (table lookups don't count)
+    int      ops          = 0;      // evaluations * program length
+};
+
+class BlockInstrumentation
+{
+public:
+    static constexpr bool enabled  = RIBCRUSHER_INSTRUMENTATION != 0;
+    static constexpr int  capacity = 512;   // blocks kept for readers, ~6 s at 512 samples / 44.1 kHz
+
+   #if RIBCRUSHER_INSTRUMENTATION
+    static uint64_t readCycleCounter() noexcept
+    {
+       #if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+        return __rdtsc();
+       #elif defined(__aarch64__) && ! defined(_MSC_VER)
+        uint64_t v;
+        asm volatile ("mrs %0, cntvct_el0" : "=r" (v));
+        return v;
+       #else
+        return uint64_t(juce::Time::getHighResolutionTicks());
+       #endif
+    }
+
+    void prepare (double newSampleRate)     { sampleRate = newSampleRate; }
+
+    // Audio thread: times one processBlock from construction to destruction
+    class BlockTimer
+    {
+    public:
+        BlockTimer (BlockInstrumentation& owner, int numSamples) noexcept
+            : instrumentation(owner), startCycles(readCycleCounter()), startTicks(juce::Time::getHighResolutionTicks())
+        {
+            stats.numSamples = numSamples;
+        }
+
+        ~BlockTimer()
+        {
+            stats.cycles = readCycleCounter() - startCycles;
+            stats.seconds = juce::Time::highResolutionTicksToSeconds(juce::Time::getHighResolutionTicks() - startTicks);
+            instrumentation.push(stats);
+        }
+
+        void addEvaluations (int count, int programLength) noexcept
+        {
+            stats.evaluations += count;
+            stats.ops += count * programLength;
+        }
+
+    private:
+        BlockInstrumentation& instrumentation;
+        BlockStats stats;
+        uint64_t startCycles;
+        juce::int64 startTicks;
+
+        JUCE_DECLARE_NON_COPYABLE (BlockTimer)
+    };
+
+    // Reader (one thread, e.g. the editor's timer): moves up to maxCount of the
+    // blocks recorded since the last call into dest, oldest first
+    int pop (BlockStats* dest, int maxCount);
+
+    // Worst block since the last resetWorst(), including blocks readers never saw
+    float getWorstDeadlineUsed() const      { return worstDeadline.load(std::memory_order_relaxed); }
+    double getWorstSeconds() const          { return worstSeconds.load(std::memory_order_relaxed); }
+    // Blocks that didn't fit in the ring because nobody was reading
+    int getNumDropped() const               { return numDropped.load(std::memory_order_relaxed); }
+    void resetWorst()                       { resetRequested.store(true, std::memory_order_relaxed); }
+
+private:
+    void push (BlockStats stats) noexcept;
+
+    double sampleRate = 44100.0;
+
+    juce::AbstractFifo fifo { capacity };
+    std::array<BlockStats, capacity> ring {};
+
+    // written by the audio thread only
+    std::atomic<float>  worstDeadline { 0.0f };
+    std::atomic<double> worstSeconds { 0.0 };
+    std::atomic<int>    numDropped { 0 };
+    std::atomic<bool>   resetRequested { false };
+
+   #else
+    void prepare (double) {}
+
+    class BlockTimer
+    {
+    public:
+        BlockTimer (BlockInstrumentation&, int) noexcept {}
+        void addEvaluations (int, int) noexcept {}
+    };
+
+    int pop (BlockStats*, int)              { return 0; }
+    float getWorstDeadlineUsed() const      { return 0.0f; }
+    double getWorstSeconds() const          { return 0.0; }
+    int getNumDropped() const               { return 0; }
+    void resetWorst()                       {}
+   #endif
+};
@@ -8,18 +8,28 @@
 
 #include "PluginProcessor.h"
 #include "PluginEditor.h"
-#include "ExprParser.h"
+#include "ExprCompiler.h"
 #include "GuiConst.h"
 
 using namespace std;
 
+static juce::String describeError (ParseResult result)
+{
+    return juce::String(parseErrorMessage(result.error)) + " at column " + juce::String(result.offset + 1);
+}
+
+// share of one core a formula may take at the current settings before it's refused,
+// and above which it's only flagged
+static constexpr double maxCpuShare   = 0.5;
+static constexpr double heavyCpuShare = 0.1;
+
 //==============================================================================
 RibCrusherAudioProcessorEditor::RibCrusherAudioProcessorEditor (RibCrusherAudioProcessor& p)
-    : AudioProcessorEditor (&p), audioProcessor (p)
+    : AudioProcessorEditor (&p), scope (p.scopeFeed), audioProcessor (p)
 {
     // Make sure that before the constructor has finished, you've set the
     // editor's size to whatever you need it to be.
-    setSize (600, 400);
+    setSize (600, 520);
     logoImg = juce::ImageFileFormat::loadFrom(BinaryData::logo_png, BinaryData::logo_pngSize);
 
     // Bitdepth slider
@@ -108,6 +118,53 @@ RibCrusherAudioProcessorEditor::RibCrusherAudioProcessorEditor (RibCrusherAudioP
     wrapToggle.setClickingTogglesState(true);
     addAndMakeVisible(wrapToggle);
 
+    sharedTToggle.setButtonText("Same t on all channels");
+    sharedTToggle.setTooltip("Off: channels take turns advancing t, which decorrelates them (the original stereo sound)");
+    addAndMakeVisible(sharedTToggle);
+    sharedTAttachment = make_unique<juce::AudioProcessorValueTreeState::ButtonAttachment>(audioProcessor.apvts, "SHAREDT", sharedTToggle);
+
+    // oversampled "clean crush" mode, the items have to be there before the attachments
+    oversamplingBox.addItemList({ "No oversampling", "2x", "4x", "8x" }, 1);
+    oversamplingBox.setTooltip("Run the sample & hold and the quantizer oversampled to keep aliasing down (adds latency)");
+    addAndMakeVisible(oversamplingBox);
+    oversamplingFilterBox.addItemList({ "IIR", "FIR" }, 1);
+    oversamplingFilterBox.setTooltip("Anti-aliasing filter: polyphase IIR (less latency) or linear phase FIR");
+    addAndMakeVisible(oversamplingFilterBox);
+    oversamplingAttachment = make_unique<juce::AudioProcessorValueTreeState::ComboBoxAttachment>(audioProcessor.apvts, "OVERSAMPLING", oversamplingBox);
+    oversamplingFilterAttachment = make_unique<juce::AudioProcessorValueTreeState::ComboBoxAttachment>(audioProcessor.apvts, "OSFILTER", oversamplingFilterBox);
+
+    midiModeBox.addItemList({ "MIDI off", "MIDI mono", "MIDI poly" }, 1);
+    midiModeBox.setTooltip("Play the formula from MIDI notes: each note runs it with its own t, faster for higher notes (middle C is the normal speed)");
+    addAndMakeVisible(midiModeBox);
+    midiModeAttachment = make_unique<juce::AudioProcessorValueTreeState::ComboBoxAttachment>(audioProcessor.apvts, "MIDIMODE", midiModeBox);
+
+    if (BlockInstrumentation::enabled)
+    {
+        cpuToggle.setButtonText("CPU");
+        cpuToggle.setTooltip("Show how much of each audio block's deadline RibCrusher uses");
+        cpuToggle.setClickingTogglesState(true);
+        cpuToggle.onClick = [this]()
+        {
+            cpuLabel.setVisible(cpuToggle.getToggleState());
+            if (cpuToggle.getToggleState())
+            {
+                // start from a clean slate: skip what piled up while hidden
+                while (audioProcessor.instrumentation.pop(blockStats.data(), int(blockStats.size())) > 0) {}
+                audioProcessor.instrumentation.resetWorst();
+                numOverruns = 0;
+                startTimerHz(10);
+            }
+            else
+            {
+                stopTimer();
+            }
+        };
+        addAndMakeVisible(cpuToggle);
+
+        cpuLabel.setColour(juce::Label::textColourId, juce::Colours::orange);
+        addChildComponent(cpuLabel);
+    }
+
     infoButton.setColour(juce::TextButton::textColourOnId, juce::Colours::orange);
     addAndMakeVisible(infoButton);
     infoButton.onClick = [this]()
@@ -129,47 +186,103 @@ RibCrusherAudioProcessorEditor::RibCrusherAudioProcessorEditor (RibCrusherAudioP
           "- Bitwise AND &\n"
           "- Bitwise exclusive OR ^\n"
           "- Bitwise inclusive OR |\n"
+          "- Conditional c ? a : b\n\n"
+          "Statements separated by commas can set variables and constant arrays, "
+          "the last one gives the result: a=t>>8, n=[3,5,8,5], t*n[a&3]\n\n"
+          "y1 is the previous result and m[0] to m[15] keep their value between samples, "
+          "for feedback: m[0] += (t*3&255) - m[0] >> 3, m[0]\n\n"
           "For help, visit: https://github.com/viljavai/RibCrusher"
       );
     };
 
     addAndMakeVisible(errorLabel);
+    addAndMakeVisible(scope);
 
     exprEditor.setMultiLine(false);
     exprEditor.setColour(juce::TextEditor::textColourId, juce::Colours::orange);
     exprEditor.setColour(juce::TextEditor::outlineColourId, juce::Colours::orange);
     exprEditor.setColour(juce::TextEditor::shadowColourId, juce::Colours::black);
 
-    // on startup
-    auto expr = audioProcessor.apvts.state.getProperty("expression", "x").toString();
-    exprEditor.setText(expr, juce::dontSendNotification);
-    audioProcessor.latestExpr = expr;
-    try {
-      audioProcessor.parsedExpr = shuntingYard(expr.toStdString());
-    } catch (const std::exception& e) {
-        errorLabel.setText(e.what(), juce::dontSendNotification);
-    audioProcessor.parsedExpr = shuntingYard("x");
-    exprEditor.setText("x", juce::dontSendNotification);
-}
+    // on startup: the processor compiled it already when the state was loaded
+    exprEditor.setText(audioProcessor.latestExpr, juce::dontSendNotification);
+    if (! audioProcessor.latestExprResult.ok())
+        errorLabel.setText(describeError(audioProcessor.latestExprResult), juce::dontSendNotification);
 
+    // runs on every keystroke, the formula is compiled and timed on the profiler's
+    // thread and only swapped in by profiled() if it fits
     exprEditor.onTextChange = [this]() {
-      audioProcessor.latestExpr = exprEditor.getText();
-      audioProcessor.apvts.state.setProperty("expression", exprEditor.getText(), nullptr);
-
-      try {
-        audioProcessor.parsedExpr = shuntingYard(exprEditor.getText().toStdString());
-        audioProcessor.tCount = 0;
-        errorLabel.setText("", juce::dontSendNotification);
-      } catch (const exception& e) {
-          errorLabel.setText(e.what(), juce::dontSendNotification);
-      }
+      profiler.profile(exprEditor.getText(), audioProcessor.jitEnabled.load());
     };
   
     addAndMakeVisible(exprEditor);
 }
 
+void RibCrusherAudioProcessorEditor::profiled (const ExprProfiler::Result& result)
+{
+    // typed on since, the newer text is on its way
+    if (result.text != exprEditor.getText())
+        return;
+
+    // a half typed formula just keeps the last good one playing
+    audioProcessor.latestExprResult = result.parse;
+    if (result.expr == nullptr)
+    {
+        audioProcessor.latestExpr = result.text;
+        audioProcessor.apvts.state.setProperty("expression", result.text, nullptr);
+        errorLabel.setText(describeError(result.parse), juce::dontSendNotification);
+        return;
+    }
+
+    const double cpuShare = result.nanosPerEvaluation * 1.0e-9 * audioProcessor.getEvaluationsPerSecond(*result.expr);
+    // ns per evaluation is the same number as us per 1000 of them
+    const juce::String cost = juce::String(result.nanosPerEvaluation, 1) + juce::String(juce::CharPointer_UTF8(" \xc2\xb5s/1k samples, "))
+                            + juce::String(100.0 * cpuShare, 1) + "% CPU";
+
+    // not saved either, so reloading the session doesn't bring it back
+    if (cpuShare > maxCpuShare)
+    {
+        errorLabel.setText("Too heavy (" + cost + "), keeping the last formula", juce::dontSendNotification);
+        return;
+    }
+
+    audioProcessor.latestExpr = result.text;
+    audioProcessor.apvts.state.setProperty("expression", result.text, nullptr);
+    ParseResult ignored;
+    audioProcessor.setExpression(result.text, ignored);
+
+    // show what the optimizer saved and what it costs
+    errorLabel.setText(juce::String(result.expr->program.sourceLength) + " ops -> " + juce::String(result.expr->program.length)
+                       + ", " + cost + (cpuShare > heavyCpuShare ? ", heavy!" : ""),
+                       juce::dontSendNotification);
+}
+
 RibCrusherAudioProcessorEditor::~RibCrusherAudioProcessorEditor()
 {
+    stopTimer();
+}
+
+void RibCrusherAudioProcessorEditor::timerCallback()
+{
+    const int count = audioProcessor.instrumentation.pop(blockStats.data(), int(blockStats.size()));
+    if (count == 0)
+        return;
+
+    double deadlineSum = 0.0;
+    juce::int64 samples = 0, ops = 0;
+    for (int i=0; i<count; ++i)
+    {
+        deadlineSum += blockStats[size_t(i)].deadlineUsed;
+        samples += blockStats[size_t(i)].numSamples;
+        ops += blockStats[size_t(i)].ops;
+        if (blockStats[size_t(i)].deadlineUsed > 1.0f)
+            ++numOverruns;
+    }
+
+    cpuLabel.setText(juce::String(100.0 * deadlineSum / count, 1) + "% avg, "
+                     + juce::String(100.0f * audioProcessor.instrumentation.getWorstDeadlineUsed(), 1) + "% peak, "
+                     + juce::String(double(ops) / juce::jmax(juce::int64(1), samples), 1) + " ops/sample, "
+                     + juce::String(numOverruns) + " overruns",
+                     juce::dontSendNotification);
 }
 
 //==============================================================================
@@ -202,10 +315,17 @@ void RibCrusherAudioProcessorEditor::resized()
 
     exprEditor.setBounds(20, 20, 300, 30);
 
-    errorLabel.setBounds(18, 50, 300, 30); // Position below exprEditor
+    errorLabel.setBounds(18, 50, 330, 30); // Position below exprEditor
     errorLabel.setColour(juce::Label::textColourId, juce::Colours::orange);
 
     infoButton.setBounds(getWidth() - 45, getHeight()-40, 30, 30);
     wrapToggle.setBounds(20, 350, 150, 24);
+    oversamplingBox.setBounds(20, 316, 140, 24);
+    oversamplingFilterBox.setBounds(170, 316, 70, 24);
+    sharedTToggle.setBounds(250, 316, 180, 24);
+    midiModeBox.setBounds(440, 316, 100, 24);
+    cpuToggle.setBounds(180, 350, 60, 24);
+    cpuLabel.setBounds(240, 350, 300, 24);
+    scope.setBounds(20, 390, 520, 110);
 
   }
@@ -8,15 +8,18 @@
 
 #pragma once
 
-#include "../JuceLibraryCode/JuceHeader.h"
+#include <JuceHeader.h>
 #include "PluginProcessor.h"
+#include "ScopeComponent.h"
+#include "ExprProfiler.h"
 
 using namespace std;
 
 //==============================================================================
 /**
 */
-class RibCrusherAudioProcessorEditor  : public juce::AudioProcessorEditor
+class RibCrusherAudioProcessorEditor  : public juce::AudioProcessorEditor,
+                                        private juce::Timer
 {
 public:
     RibCrusherAudioProcessorEditor (RibCrusherAudioProcessor&);
@@ -37,8 +40,13 @@ private:
 
     juce::ToggleButton ditherButton;
     juce::ToggleButton wrapToggle;
+    juce::ToggleButton sharedTToggle;
     juce::TextButton infoButton { "?" };
 
+    juce::ComboBox oversamplingBox;
+    juce::ComboBox oversamplingFilterBox;
+    juce::ComboBox midiModeBox;
+
     juce::TextEditor exprEditor;
 
     //Slider object ^ should be declared before this
@@ -49,6 +57,11 @@ private:
 
     unique_ptr<juce::AudioProcessorValueTreeState::ButtonAttachment> ditherAttachment;
     unique_ptr<juce::AudioProcessorValueTreeState::ButtonAttachment> wrapToggleAttachment;
+    unique_ptr<juce::AudioProcessorValueTreeState::ButtonAttachment> sharedTAttachment;
+
+    unique_ptr<juce::AudioProcessorValueTreeState::ComboBoxAttachment> oversamplingAttachment;
+    unique_ptr<juce::AudioProcessorValueTreeState::ComboBoxAttachment> oversamplingFilterAttachment;
+    unique_ptr<juce::AudioProcessorValueTreeState::ComboBoxAttachment> midiModeAttachment;
 
     unique_ptr<juce::AudioProcessorValueTreeState::Listener> editorAttachment;
 
@@ -62,7 +75,20 @@ private:
 
     juce::Image logoImg;
 
+    ScopeComponent scope;
+
+    // CPU overlay, fed by the processor's BlockInstrumentation
+    juce::ToggleButton cpuToggle;
+    juce::Label cpuLabel;
+    std::array<BlockStats, BlockInstrumentation::capacity> blockStats;
+    int numOverruns = 0;
+    void timerCallback() override;
+
     RibCrusherAudioProcessor& audioProcessor;
 
+    // times each formula before it's swapped in, declared last so its thread stops first
+    ExprProfiler profiler { [this] (const ExprProfiler::Result& result) { profiled(result); } };
+    void profiled (const ExprProfiler::Result& result);
+
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (RibCrusherAudioProcessorEditor)
 };
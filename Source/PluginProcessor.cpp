@@ -8,7 +8,7 @@
 
 #include "PluginProcessor.h"
 #include "PluginEditor.h"
-#include "ExprParser.h"
+#include "ExprCompiler.h"
 
 using namespace std;
 //==============================================================================
@@ -29,10 +29,37 @@ RibCrusherAudioProcessor::RibCrusherAudioProcessor()
                     apvts(*this, nullptr, "Parameters", createParameterLayout())
 #endif
 {
+    params.bitDepth   = apvts.getRawParameterValue("BITDEPTH");
+    params.samplerate = apvts.getRawParameterValue("SAMPLERATE");
+    params.bitShift   = apvts.getRawParameterValue("BITSHIFT");
+    params.dither     = apvts.getRawParameterValue("DITHER");
+    params.byteWrap   = apvts.getRawParameterValue("BYTEWRAP");
+    params.mix        = apvts.getRawParameterValue("MIX");
+    params.oversampling       = apvts.getRawParameterValue("OVERSAMPLING");
+    params.oversamplingFilter = apvts.getRawParameterValue("OSFILTER");
+    params.sharedT            = apvts.getRawParameterValue("SHAREDT");
+    params.midiMode           = apvts.getRawParameterValue("MIDIMODE");
+
+    apvts.addParameterListener("OVERSAMPLING", this);
+    apvts.addParameterListener("OSFILTER", this);
+
+    // the default formula until a saved state or the editor sets another
+    restoreExpression(latestExpr, nullptr);
+
+    backgroundThread.addTimeSliceClient(&exprHandoff);
+    backgroundThread.addTimeSliceClient(this);
+    backgroundThread.startThread();
 }
 
 RibCrusherAudioProcessor::~RibCrusherAudioProcessor()
 {
+    apvts.removeParameterListener("OVERSAMPLING", this);
+    apvts.removeParameterListener("OSFILTER", this);
+    cancelPendingUpdate();
+
+    backgroundThread.removeTimeSliceClient(this);
+    backgroundThread.removeTimeSliceClient(&exprHandoff);
+    backgroundThread.stopThread(1000);
 }
 
 //==============================================================================
@@ -97,6 +124,167 @@ void RibCrusherAudioProcessor::changeProgramName (int index, const juce::String&
 {
 }
 
+void RibCrusherAudioProcessor::setProgram (const Program& newProgram)
+{
+    publish(ExprCache::makeUncached(newProgram));
+}
+
+CompiledExpr::Ptr RibCrusherAudioProcessor::setExpression (const juce::String& text, ParseResult& result)
+{
+    auto expr = exprCache->get(text.toStdString(), result);
+    if (expr != nullptr)
+        publish(expr);
+    return expr;
+}
+
+void RibCrusherAudioProcessor::restoreExpression (const juce::String& text, const Program* stored)
+{
+    latestExpr = text;
+    apvts.state.setProperty("expression", text, nullptr);
+
+    // the text decides what plays, a stored program never goes into the shared cache
+    if (auto expr = exprCache->get(text.toStdString(), latestExprResult))
+    {
+        publish(expr);
+    }
+    else if (stored != nullptr)
+    {
+        // saved while a half typed formula was in the editor: play what was playing then
+        publish(ExprCache::makeUncached(*stored));
+    }
+    else
+    {
+        ParseResult ignored;
+        publish(exprCache->get("x", ignored));
+    }
+}
+
+void RibCrusherAudioProcessor::publish (CompiledExpr::Ptr expr)
+{
+    {
+        // a new formula starts from 0, not from cells loaded for the one before it
+        const juce::SpinLock::ScopedLockType stateLock (exprStateLock);
+        exprStatesRestored = false;
+    }
+
+    const juce::ScopedLock sl (publishLock);
+    latestSerial = expr->serial;
+    published = expr;
+    exprHandoff.publish(expr);
+
+    // t-only formulas with a short period get rendered into a table in the background,
+    // unless another instance already did
+    pendingTable = (expr->byteTable.empty() && expr->tablePeriodLog2 >= 0) ? expr : nullptr;
+}
+
+int RibCrusherAudioProcessor::useTimeSlice()
+{
+    CompiledExpr::Ptr source;
+    {
+        const juce::ScopedLock sl (publishLock);
+        std::swap(source, pendingTable);
+    }
+    if (source == nullptr)
+        return 50;
+
+    auto withTable = exprCache->withByteTable(source);
+
+    // don't replace an expression that was typed in while we were rendering
+    const juce::ScopedLock sl (publishLock);
+    if (withTable->serial == latestSerial)
+        exprHandoff.publish(withTable);
+    return 0;
+}
+
+// Compiled program as it was playing, so a session sounds the same after loading
+// even if a later version optimizes differently
+static void writeProgram (juce::OutputStream& stream, const Program& program)
+{
+    stream.writeInt(programFormatVersion);
+    stream.writeInt(program.length);
+    stream.writeInt(program.stackDepth);
+    stream.writeInt(program.numRegisters);
+    stream.writeInt(program.sourceLength);
+    for (int i=0; i<program.length; ++i)
+    {
+        stream.writeByte(char(program.code[i].op));
+        stream.writeInt(program.code[i].arg);
+    }
+    stream.writeInt(program.tableLength);
+    for (int i=0; i<program.tableLength; ++i)
+        stream.writeInt(program.table[i]);
+}
+
+// false if it's missing, from another opcode set or not safe to run
+static bool readProgram (juce::InputStream& stream, Program& program)
+{
+    if (stream.getNumBytesRemaining() < 20 || stream.readInt() != programFormatVersion)
+        return false;
+
+    const int length = stream.readInt();
+    program.stackDepth   = stream.readInt();
+    program.numRegisters = stream.readInt();
+    program.sourceLength = stream.readInt();
+    if (length < 0 || length > maxProgramLength || stream.getNumBytesRemaining() < juce::int64(length) * 5)
+        return false;
+
+    program.length = length;
+    for (int i=0; i<length; ++i)
+    {
+        program.code[i].op  = OpCode(uint8_t(stream.readByte()));
+        program.code[i].arg = stream.readInt();
+    }
+
+    const int tableLength = stream.getNumBytesRemaining() >= 4 ? stream.readInt() : -1;
+    if (tableLength < 0 || tableLength > maxArrayElements || stream.getNumBytesRemaining() < juce::int64(tableLength) * 4)
+        return false;
+    program.tableLength = tableLength;
+    for (int i=0; i<tableLength; ++i)
+        program.table[i] = stream.readInt();
+    return verifyProgram(program);
+}
+
+// y1 and the cells of every channel, so feedback carries on where it was after loading
+static void writeExprStates (juce::OutputStream& stream, const ExprState* states, int numStates)
+{
+    stream.writeInt(numStates);
+    stream.writeInt(maxCells);
+    for (int i=0; i<numStates; ++i)
+    {
+        for (int c=0; c<maxCells; ++c)
+            stream.writeInt(states[i].cells[c]);
+        stream.writeInt(states[i].y1);
+    }
+}
+
+// missing channels and cells start at 0, extra ones are skipped
+static bool readExprStates (juce::InputStream& stream, ExprState* states, int numStates)
+{
+    if (stream.getNumBytesRemaining() < 8)
+        return false;
+    const int count = stream.readInt();
+    const int cells = stream.readInt();
+    if (count < 0 || cells < 0 || cells > 4096 || stream.getNumBytesRemaining() < juce::int64(count) * (cells + 1) * 4)
+        return false;
+
+    for (int i=0; i<count; ++i)
+    {
+        ExprState state;
+        for (int c=0; c<cells; ++c)
+        {
+            const int value = stream.readInt();
+            if (c < maxCells)
+                state.cells[c] = value;
+        }
+        state.y1 = stream.readInt();
+        if (i < numStates)
+            states[i] = state;
+    }
+    for (int i=count; i<numStates; ++i)
+        states[i] = ExprState();
+    return true;
+}
+
 //==============================================================================
 void RibCrusherAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 {
@@ -104,14 +292,98 @@ void RibCrusherAudioProcessor::prepareToPlay (double sampleRate, int samplesPerB
     // initialisation that you need..
     hostSamplerate = sampleRate;
     auto channelsNum = getTotalNumInputChannels();
-    sampleCount.assign(channelsNum,0.0f);
-    currentSamples.assign(channelsNum,0.0f);
+    // the first sample starts a hold, and the formula starts over
+    holdCountdown = 0.0;
+    tCount = 0;
+    // per-tick scratch, sized once so processBlock never allocates
+    // (longer host blocks are processed in pieces of this size)
+    const size_t scratchSize = size_t(juce::jmax(1, samplesPerBlock) << maxOversamplingLog2);
+    tickPositions.assign(scratchSize, 0);
+    exprInput.assign(scratchSize * maxChannels, 0);
+    exprOutput.assign(scratchSize * maxChannels, 0);
+    heldValues.assign(scratchSize * maxChannels, 0.0f);
+    ditherNoise.assign(scratchSize, 0.0f);
+    ditherNoiseFixed.assign(scratchSize, 0);
+    const size_t voiceLanes = size_t(voiceBatchTicks * VoicePool::maxVoices * maxChannels);
+    voiceT.assign(voiceLanes, 0);
+    voiceInput.assign(voiceLanes, 0);
+    voiceOutput.assign(voiceLanes, 0);
+    voices.reset();
+    activeMidiMode = int(params.midiMode->load());
+
+    // reseed on every prepare so renders of the same material come out identical
+    for (int ch=0; ch<maxChannels; ++ch)
+    {
+        channelStates.heldSample[ch] = 0.0f;
+        channelStates.dither[ch].setSeed(ditherSeed + uint64_t(ch));
+    }
+
+    // the formula state starts at 0 too, a saved one that was just loaded is still
+    // taken over by the first block
+    {
+        const juce::SpinLock::ScopedLockType sl (exprStateLock);
+        for (int ch=0; ch<maxChannels; ++ch)
+        {
+            channelStates.expr[ch] = ExprState();
+            if (! exprStatesRestored)
+                sharedExprStates[ch] = ExprState();
+        }
+    }
+
+    for (int filter=0; filter<2; ++filter)
+    {
+        for (int factor=0; factor<maxOversamplingLog2; ++factor)
+        {
+            auto& os = oversamplers[filter][factor];
+            os = std::make_unique<juce::dsp::Oversampling<float>>(size_t(juce::jmax(1, channelsNum)), size_t(factor + 1),
+                                                                   filter == 0 ? juce::dsp::Oversampling<float>::filterHalfBandPolyphaseIIR
+                                                                               : juce::dsp::Oversampling<float>::filterHalfBandFIREquiripple,
+                                                                   true, true);
+            os->initProcessing(size_t(samplesPerBlock));
+            oversamplerLatency[filter][factor] = os->getLatencyInSamples();
+        }
+    }
+    activeOversampler = nullptr;
 
     juce::dsp::ProcessSpec spec = { sampleRate, static_cast<juce::uint32> (samplesPerBlock), static_cast<juce::uint32> (getMainBusNumOutputChannels())  };
     dryWetMixer.prepare(spec);
+
+    // the latency of whatever mode is selected now, parameter changes update it later
+    const int oversamplingIndex = int(params.oversampling->load());
+    if (oversamplingIndex > 0)
+        activeOversampler = oversamplers[int(params.oversamplingFilter->load())][oversamplingIndex - 1].get();
+
+    const float latency = activeOversampler != nullptr ? activeOversampler->getLatencyInSamples() : 0.0f;
+    dryWetMixer.setWetLatency(latency);
+    setLatencySamples(latencyForCurrentMode());
+
+    smoothedSamplerate.reset(sampleRate, 0.05);
+    smoothedSamplerate.setCurrentAndTargetValue(params.samplerate->load());
+
+    instrumentation.prepare(sampleRate);
+    scopeFeed.prepare(sampleRate);
     
 }
 
+int RibCrusherAudioProcessor::latencyForCurrentMode() const
+{
+    const int oversamplingIndex = int(params.oversampling->load());
+    if (oversamplingIndex <= 0)
+        return 0;
+    return juce::roundToInt(oversamplerLatency[int(params.oversamplingFilter->load())][oversamplingIndex - 1]);
+}
+
+// can come from the audio thread when the host automates the mode
+void RibCrusherAudioProcessor::parameterChanged (const juce::String&, float)
+{
+    triggerAsyncUpdate();
+}
+
+void RibCrusherAudioProcessor::handleAsyncUpdate()
+{
+    setLatencySamples(latencyForCurrentMode());
+}
+
 void RibCrusherAudioProcessor::releaseResources()
 {
     // When playback stops, you can use this as an opportunity to free up any
@@ -147,16 +419,17 @@ bool RibCrusherAudioProcessor::isBusesLayoutSupported (const BusesLayout& layout
 void RibCrusherAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
 {
     juce::ScopedNoDenormals noDenormals;
+    BlockInstrumentation::BlockTimer blockTimer (instrumentation, buffer.getNumSamples());
     auto totalNumInputChannels  = getTotalNumInputChannels();
     auto totalNumOutputChannels = getTotalNumOutputChannels();
 
-    int bitDepthVal = apvts.getRawParameterValue("BITDEPTH")->load();
-    int samplerateVal = apvts.getRawParameterValue("SAMPLERATE")->load();
-    int bitShiftVal = apvts.getRawParameterValue("BITSHIFT")->load();
-    bool ditherEnabled = apvts.getRawParameterValue("DITHER")->load();
-    bool wrapEnabled = apvts.getRawParameterValue("BYTEWRAP")->load();
+    // one snapshot of the parameters per block
+    const auto crush = CrushCoefficients::make(int(params.bitDepth->load()), int(params.bitShift->load()),
+                                               params.dither->load() >= 0.5f, params.byteWrap->load() >= 0.5f);
+
+    // glide towards the target rate instead of jumping when it's automated
+    smoothedSamplerate.setTargetValue(params.samplerate->load());
 
-    int N = samplerateVal > 0 ? int(hostSamplerate/samplerateVal) : 1;
     // In case we have more outputs than inputs, this code clears any output
     // channels that didn't contain input data, (because these aren't
     // guaranteed to be empty - they may contain garbage).
@@ -167,90 +440,431 @@ void RibCrusherAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, j
         buffer.clear (i, 0, buffer.getNumSamples());
     //======================================================//
 
+    // switch to a newly published expression at the block boundary
+    // (the same formula again, e.g. once its table is rendered, keeps t running)
+    if (exprHandoff.acquire() && exprHandoff.current()->serial != activeSerial)
+    {
+        activeSerial = exprHandoff.current()->serial;
+        tCount = 0;
+        for (auto& state : channelStates.expr)
+            state = ExprState();
+    }
+    exchangeExprStates();
+
+    const CompiledExpr* expr = exprHandoff.current();
+    jassert (expr != nullptr);
+
+    // native code if we have it, otherwise the bytecode interpreter
+    auto jit = (jitEnabled.load() && expr->jit != nullptr) ? expr->jit->getFunction() : nullptr;
+
     juce::dsp::AudioBlock<float> audioBlock(buffer);
     dryWetMixer.pushDrySamples(audioBlock);
+    auto inputBlock = audioBlock.getSubsetChannelBlock(0, size_t(totalNumInputChannels));
+
+    // Oversampled ("clean crush") mode: the hold and the quantizer run at a multiple
+    // of the host rate and the result goes through the oversampler's anti-aliasing
+    // filter on the way down. Off is the plain lo-fi path, untouched.
+    const int oversamplingIndex = int(params.oversampling->load());
+    const int filterIndex = int(params.oversamplingFilter->load());
+    auto* oversampler = oversamplingIndex > 0 ? oversamplers[size_t(filterIndex)][size_t(oversamplingIndex - 1)].get() : nullptr;
+    if (oversampler != activeOversampler)
+    {
+        if (oversampler != nullptr)
+            oversampler->reset();
+        activeOversampler = oversampler;
 
-    auto& tokens = parsedExpr;
+        // the host hears about the new latency from handleAsyncUpdate()
+        dryWetMixer.setWetLatency(oversampler != nullptr ? oversampler->getLatencyInSamples() : 0.0f);
+    }
+
+    const bool sharedT = params.sharedT->load() >= 0.5f;
+
+    // MIDI mode: notes play the formula instead of the running t
+    const int midiMode = int(params.midiMode->load());
+    const int voiceLimit = voiceLimitFor(midiMode);
+    if (midiMode != activeMidiMode)
+    {
+        voices.reset();
+        activeMidiMode = midiMode;
+    }
+
+    auto processedBlock = oversampler != nullptr ? oversampler->processSamplesUp(inputBlock) : inputBlock;
+    const int factor = oversampler != nullptr ? int(oversampler->getOversamplingFactor()) : 1;
+    const double processRate = hostSamplerate * factor;
+
+    // Sub-blocks: the block is cut where MIDI events land (in MIDI mode) and, while the
+    // rate is gliding, every maxSegmentLength samples, so changes take effect on time
+    // instead of a whole host block at once. Each piece runs with constant parameters.
+    // Nothing moving and no notes is one piece, exactly the work it was before.
+    int evaluations = 0;    // for the instrumentation, optimized away when it's compiled out
+    const int numSamples = buffer.getNumSamples();
+    auto midiEvent = midiMessages.cbegin();
+    for (int pos=0; pos<numSamples;)
+    {
+        for (; midiEvent != midiMessages.cend() && (*midiEvent).samplePosition <= pos; ++midiEvent)
+            if (voiceLimit > 0)
+                handleMidiEvent(*midiEvent, voiceLimit);
+
+        int end = smoothedSamplerate.isSmoothing() ? juce::jmin(numSamples, pos + maxSegmentLength) : numSamples;
+        if (voiceLimit > 0 && midiEvent != midiMessages.cend())
+            end = juce::jmin(end, (*midiEvent).samplePosition);
+
+        const int len = end - pos;
+        const float samplerateVal = smoothedSamplerate.skip(len);
+        evaluations += crushHolds(processedBlock.getSubBlock(size_t(pos * factor), size_t(len * factor)),
+                                  holdPeriodFor(processRate, samplerateVal), crush, *expr, jit, sharedT, voiceLimit > 0);
+        pos = end;
+    }
+    // events stamped past the end of the block (some hosts do) still count
+    for (; midiEvent != midiMessages.cend(); ++midiEvent)
+        if (voiceLimit > 0)
+            handleMidiEvent(*midiEvent, voiceLimit);
+
+    if (oversampler != nullptr)
+        oversampler->processSamplesDown(inputBlock);
+
+    blockTimer.addEvaluations(evaluations, expr->program.length);
+    scopeFeed.push(inputBlock);
+
+    // DryWetMixer ramps the mix itself, so handing it the value once per block is enough
+    dryWetMixer.setWetMixProportion(params.mix->load());
+    dryWetMixer.mixWetSamples(audioBlock);
+}
+
+void RibCrusherAudioProcessor::exchangeExprStates()
+{
+    // a block without the lock just tries again next time
+    const juce::SpinLock::ScopedTryLockType lock (exprStateLock);
+    if (! lock.isLocked())
+        return;
+
+    if (! exprStatesRestored)
+    {
+        std::copy(channelStates.expr, channelStates.expr + maxChannels, sharedExprStates);
+    }
+    else if (exprStatesSerial == activeSerial)
+    {
+        std::copy(sharedExprStates, sharedExprStates + maxChannels, channelStates.expr);
+        exprStatesRestored = false;
+    }
+}
+
+double RibCrusherAudioProcessor::getEvaluationsPerSecond (const CompiledExpr& expr) const
+{
+    if (params.byteWrap->load() >= 0.5f && expr.tablePeriodLog2 >= 0)
+        return 0.0;
 
-    for (int channel=0; channel<totalNumInputChannels; ++channel)
+    const double hostRate = hostSamplerate > 0.0 ? hostSamplerate : 44100.0;
+    const double processRate = hostRate * double(1 << int(params.oversampling->load()));
+    const double ticks = processRate / holdPeriodFor(processRate, params.samplerate->load());
+
+    const int numChannels = juce::jmax(1, getTotalNumInputChannels());
+    // with MIDI, as if every voice were playing
+    if (const int voiceLimit = voiceLimitFor(int(params.midiMode->load())))
+        return ticks * voiceLimit * (expr.readsInput ? numChannels : 1);
+
+    const bool sharedT = params.sharedT->load() >= 0.5f;
+    return ticks * ((sharedT && ! expr.readsInput) ? 1 : numChannels);
+}
+
+void RibCrusherAudioProcessor::handleMidiEvent (const juce::MidiMessageMetadata& event, int voiceLimit)
+{
+    // only channel messages matter here, sysex and the like are skipped
+    if (event.numBytes != 3)
+        return;
+
+    const int status = event.data[0] & 0xF0;
+    const int data1 = event.data[1], data2 = event.data[2];
+    if (status == 0x90 && data2 > 0)
+        voices.noteOn(data1, float(data2) / 127.0f, voiceLimit);
+    else if (status == 0x80 || status == 0x90)      // note on with velocity 0 is a note off
+        voices.noteOff(data1);
+    else if (status == 0xB0 && (data1 == 123 || data1 == 120))  // all notes off, all sound off
+        voices.reset();
+}
+
+// A new value is held every holdPeriod samples, fractional so any target rate works.
+// Whole periods are snapped exact (the float parameter rarely gives exactly
+// 44100/3), so integer ratios hold for exactly N samples forever.
+double RibCrusherAudioProcessor::holdPeriodFor (double processRate, float targetRate)
+{
+    double holdPeriod = (targetRate > 0 && processRate > 0) ? juce::jmax(1.0, processRate / targetRate) : 1.0;
+    if (std::abs(holdPeriod - std::round(holdPeriod)) < 1.0e-4)
+        holdPeriod = std::round(holdPeriod);
+    return holdPeriod;
+}
+
+int RibCrusherAudioProcessor::crushHolds (juce::dsp::AudioBlock<float> block, double holdPeriod, const CrushCoefficients& crush,
+                                          const CompiledExpr& expr, ExprJit::Function jit, bool sharedT, bool useVoices)
+{
+    const Program& program = expr.program;
+    const bool wrapEnabled = crush.wrap;
+    // voices are mixed at their velocity in float, so they stay on the float path
+    const bool integerPath = integerPipeline.load(std::memory_order_relaxed) && ! useVoices;
+
+    // the table only holds the low byte, so it's only valid with 8-bit wrap on
+    const bool useTable = wrapEnabled && ! expr.byteTable.empty();
+    const uint8_t* table = expr.byteTable.data();
+    const uint32_t tableMask = uint32_t(expr.byteTable.size()) - 1;
+
+    int evaluations = 0;
+    const int numChannels = juce::jmin(int(block.getNumChannels()), maxChannels);
+
+    // Sample & hold decimator: the expression and the crusher only run at the start
+    // of each hold ("ticks"), on a compact array, and the results are then spread
+    // out over the held samples. The work shrinks along with the target rate.
+    const int numSamples = int(block.getNumSamples());
+    const int chunkSize = int(tickPositions.size());
+    for (int start=0; start<numSamples && chunkSize > 0; start+=chunkSize)
     {
-        auto* channelData = buffer.getWritePointer(channel);
-
-        for (int sample=0; sample<buffer.getNumSamples(); ++sample)
-        {   
-            float sampleValue;
-            // 1) expression parsing
-            // Sample & hold for bytebeat t
-            if (sampleCount[channel] == 0)
+        const int len = juce::jmin(chunkSize, numSamples - start);
+
+        // 1) where the holds start, the same for every channel
+        int numTicks = 0;
+        for (int i=0; i<len; ++i)
+        {
+            if (holdCountdown <= 0.0)
             {
-                tCount++;
-                int inputInt = int(channelData[sample] * 127.5f + 128);
-                int bytebeatValue = evaluateExpr(parsedExpr, tCount, inputInt);
+                holdCountdown += holdPeriod;
+                tickPositions[size_t(numTicks++)] = i;
+            }
+            holdCountdown -= 1.0;
+        }
 
-                if (wrapEnabled)
-                    sampleValue = (bytebeatValue & 0xFF) / 127.5f - 1.0f;
+        if (numTicks > 0 && useVoices)
+        {
+            evaluations += evaluateVoices(block, start, numTicks, numChannels, expr, jit, wrapEnabled);
+        }
+        else if (numTicks > 0)
+        {
+            // 2) the expression for all channels in one pass, with t counting ticks.
+            // Shared t: the channels of a tick sit next to each other and get the same t,
+            // and an expression that doesn't read x is only run once per tick.
+            // Per-channel t: each channel takes the next numTicks values of t in turn
+            // (t runs numChannels times as fast, the original stereo behaviour).
+            const int lanesPerT = sharedT ? (expr.readsInput ? numChannels : 1) : 1;
+            const int tickStride = sharedT ? lanesPerT : 1;
+            const int channelStride = sharedT ? (lanesPerT > 1 ? 1 : 0) : numTicks;
+            const int n = sharedT ? numTicks * lanesPerT : numTicks * numChannels;
+
+            if (useTable)
+            {
+                for (int i=0; i<n; ++i)
+                    exprOutput[size_t(i)] = table[(tCount + 1 + uint32_t(i / lanesPerT)) & tableMask];
+            }
+            else
+            {
+                if (expr.readsInput)
+                {
+                    for (int channel=0; channel<numChannels; ++channel)
+                    {
+                        const auto* channelData = block.getChannelPointer(size_t(channel)) + start;
+                        int* dest = exprInput.data() + channel * channelStride;
+                        for (int k=0; k<numTicks; ++k)
+                            dest[k * tickStride] = int(channelData[tickPositions[size_t(k)]] * 127.5f + 128);
+                    }
+                }
+
+                if (expr.stateful)
+                {
+                    // each call needs the one before it on its channel, so one at a time,
+                    // in order: a shared t without x only runs (and keeps state) for the first
+                    for (int i=0; i<n; ++i)
+                    {
+                        const uint32_t t = tCount + 1 + uint32_t(i / lanesPerT);
+                        ExprState* state = &channelStates.expr[sharedT ? i % lanesPerT : i / numTicks];
+                        exprOutput[size_t(i)] = jit != nullptr ? jit(t, exprInput[size_t(i)], state)
+                                                               : runProgram(program, t, exprInput[size_t(i)], state);
+                    }
+                }
+                else if (jit != nullptr)
+                {
+                    for (int i=0; i<n; ++i)
+                        exprOutput[size_t(i)] = jit(tCount + 1 + uint32_t(i / lanesPerT), exprInput[size_t(i)], nullptr);
+                }
                 else
-                    sampleValue = juce::jlimit(-1.0f, 1.0f, float(bytebeatValue) / 127.5f - 1.0f);
+                {
+                    evaluateBlock(program, tCount + 1, exprInput.data(), exprOutput.data(), n, lanesPerT);
+                }
+                evaluations += n;
+            }
+            tCount += uint32_t(n / lanesPerT);
+
+            for (int channel=0; channel<numChannels; ++channel)
+            {
+                const int* values = exprOutput.data() + channel * channelStride;
+                float* held = heldValues.data() + channel * chunkSize;
+
+                // 3-5) straight from the expression's ints, one conversion to float at the end
+                if (integerPath)
+                {
+                    if (crush.dither)
+                        channelStates.dither[channel].fillTpdf(ditherNoiseFixed.data(), numTicks, crush.ditherLevel);
+                    crushValues(values, tickStride, ditherNoiseFixed.data(), held, numTicks, crush);
+                }
+                else if (wrapEnabled)
+                {
+                    for (int k=0; k<numTicks; ++k)
+                        held[k] = (values[k * tickStride] & 0xFF) / 127.5f - 1.0f;
+                }
+                else
+                {
+                    for (int k=0; k<numTicks; ++k)
+                        held[k] = juce::jlimit(-1.0f, 1.0f, float(values[k * tickStride]) / 127.5f - 1.0f);
+                }
+            }
+        }
 
-                currentSamples[channel] = sampleValue;
+        if (numTicks > 0 && ! integerPath)
+        {
+            for (int channel=0; channel<numChannels; ++channel)
+            {
+                float* held = heldValues.data() + channel * chunkSize;
+
+                if (crush.dither) {
+                    // 3) TPDF dithering
+                    // scale ditherVal by one quantization step
+                    channelStates.dither[channel].fillTpdf(ditherNoise.data(), numTicks, crush.ditherScale);
+                }
+
+                // 4) Change bit depth (with dither)
+                // We want int values (signed n-bit int) between 2^(bitDepthVal-1)-1 and -(2^(bitDepthVal-1))
+                // ex. bitDepthVal=8 -> int values between 127 and -128 (-127)
+                // quantization: round to the nearest int value in range [-maxVal, maxVal]
+                // 5) bit shift, then normalize back to [-1, 1]
+                crushBlock(held, ditherNoise.data(), held, numTicks, crush);
             }
-            channelData[sample] = currentSamples[channel];
+        }
 
-            if (++sampleCount[channel] >= N)
-                sampleCount[channel] = 0;
+        // 6) hold each value until the next tick, starting with the one from the last chunk
+        for (int channel=0; channel<numChannels; ++channel)
+        {
+            auto* channelData = block.getChannelPointer(size_t(channel)) + start;
+            const float* held = heldValues.data() + channel * chunkSize;
 
-            // 2) downsampling, sample and hold
-            // we don't have a sample held, capture current sample
-            if (sampleCount[channel] == 0) {
-                currentSamples[channel] = sampleValue;
+            if (numTicks == len)
+            {
+                std::copy(held, held + len, channelData);
             }
-            // repeat heldSample for N samples
-            channelData[sample] = currentSamples[channel];
-            if (++sampleCount[channel] >= N) {
-                // release
-                sampleCount[channel] = 0;
+            else
+            {
+                int end = numTicks > 0 ? tickPositions[0] : len;
+                std::fill(channelData, channelData + end, channelStates.heldSample[channel]);
+                for (int k=0; k<numTicks; ++k)
+                {
+                    const int from = tickPositions[size_t(k)];
+                    end = k + 1 < numTicks ? tickPositions[size_t(k + 1)] : len;
+                    std::fill(channelData + from, channelData + end, held[k]);
+                }
             }
+            if (numTicks > 0)
+                channelStates.heldSample[channel] = held[numTicks - 1];
+        }
+    }
+    return evaluations;
+}
+
+int RibCrusherAudioProcessor::evaluateVoices (const juce::dsp::AudioBlock<float>& block, int start, int numTicks, int numChannels,
+                                              const CompiledExpr& expr, ExprJit::Function jit, bool wrap)
+{
+    static_assert(VoicePool::maxLanes >= maxChannels, "a voice needs a state per channel");
+    const int chunkSize = int(tickPositions.size());
+    for (int channel=0; channel<numChannels; ++channel)
+        std::fill_n(heldValues.data() + channel * chunkSize, numTicks, 0.0f);
+
+    const int numVoices = voices.getNumActive();
+    if (numVoices == 0)
+        return 0;
+
+    const bool useTable = wrap && ! expr.byteTable.empty();
+    const uint8_t* table = expr.byteTable.data();
+    const uint32_t tableMask = uint32_t(expr.byteTable.size()) - 1;
 
-            float ditherVal = 0.0f;
-            if (ditherEnabled) {
-                // 3) TPDF dithering
-                // scale ditherVal by one quantization step
-                float scalingFactor = 1.0f / (1 << bitDepthVal);
-                ditherVal = (random.nextFloat() - random.nextFloat()) * scalingFactor;
+    // lanes are [tick][voice][channel], a formula without x needs one lane per voice
+    const int lanesPerVoice = expr.readsInput ? numChannels : 1;
+    const int lanesPerTick = numVoices * lanesPerVoice;
+
+    int evaluations = 0;
+    for (int first=0; first<numTicks; first+=voiceBatchTicks)
+    {
+        const int count = juce::jmin(voiceBatchTicks, numTicks - first);
+        const int n = count * lanesPerTick;
+        voices.advance(voiceT.data(), count, lanesPerVoice);
+
+        if (useTable)
+        {
+            for (int i=0; i<n; ++i)
+                voiceOutput[size_t(i)] = table[voiceT[size_t(i)] & tableMask];
+        }
+        else
+        {
+            if (expr.readsInput)
+            {
+                for (int channel=0; channel<numChannels; ++channel)
+                {
+                    const auto* channelData = block.getChannelPointer(size_t(channel)) + start;
+                    for (int k=0; k<count; ++k)
+                    {
+                        const int x = int(channelData[tickPositions[size_t(first + k)]] * 127.5f + 128);
+                        int* dest = voiceInput.data() + k * lanesPerTick + channel;
+                        for (int v=0; v<numVoices; ++v)
+                            dest[v * lanesPerVoice] = x;
+                    }
+                }
             }
-            float ditheredSample = channelData[sample] + ditherVal;
-
-            // 4) Change bit depth (with dither)
-            // We want int values (signed n-bit int) between 2^(bitDepthVal-1)-1 and -(2^(bitDepthVal-1))
-            // ex. bitDepthVal=8 -> int values between 127 and -128 (-127)
-            int maxVal = (1 << (bitDepthVal - 1)) - 1;
-            // quantization:
-            // round incoming floats to the nearest int value in range [-maxVal, maxVal]
-            int intSample = int(juce::roundToInt(ditheredSample * maxVal));
-            float quantSample = static_cast<float>(intSample) / maxVal;
-
-            // substractive dither done here
-            float processedSample;
-            if (ditherEnabled) {
-                processedSample = quantSample - ditherVal;
+
+            if (expr.stateful)
+            {
+                // every voice (and lane) keeps its own state, run one tick after the other
+                for (int i=0; i<n; ++i)
+                {
+                    ExprState* state = voices.getState((i / lanesPerVoice) % numVoices, i % lanesPerVoice);
+                    voiceOutput[size_t(i)] = jit != nullptr ? jit(voiceT[size_t(i)], voiceInput[size_t(i)], state)
+                                                            : runProgram(expr.program, voiceT[size_t(i)], voiceInput[size_t(i)], state);
+                }
             }
-            else {
-                processedSample = quantSample;
+            else if (jit != nullptr)
+            {
+                for (int i=0; i<n; ++i)
+                    voiceOutput[size_t(i)] = jit(voiceT[size_t(i)], voiceInput[size_t(i)], nullptr);
+            }
+            else
+            {
+                evaluateBlock(expr.program, voiceT.data(), voiceInput.data(), voiceOutput.data(), n);
+            }
+            evaluations += n;
+        }
+
+        // each voice at its velocity, mapped to [-1, 1] the same way a single t is
+        for (int channel=0; channel<numChannels; ++channel)
+        {
+            float* held = heldValues.data() + channel * chunkSize + first;
+            const int lane = lanesPerVoice > 1 ? channel : 0;
+            for (int v=0; v<numVoices; ++v)
+            {
+                const int* values = voiceOutput.data() + v * lanesPerVoice + lane;
+                const float gain = voices.getGain(v);
+                if (wrap)
+                {
+                    for (int k=0; k<count; ++k)
+                        held[k] += gain * ((values[k * lanesPerTick] & 0xFF) / 127.5f - 1.0f);
+                }
+                else
+                {
+                    for (int k=0; k<count; ++k)
+                        held[k] += gain * juce::jlimit(-1.0f, 1.0f, float(values[k * lanesPerTick]) / 127.5f - 1.0f);
+                }
             }
-            
-            // 5) bit shift
-            int shiftedInt = (intSample << bitShiftVal);
-            shiftedInt = juce::jlimit(-maxVal, maxVal, shiftedInt);
-            // normalize
-            processedSample = float(shiftedInt) / float(maxVal);
-            
-            processedSample = juce::jlimit(-1.0f, 1.0f, processedSample);
-            channelData[sample] = processedSample;
         }
     }
-    float mixVal = apvts.getRawParameterValue("MIX")->load();
-    dryWetMixer.setWetMixProportion(mixVal);
-    dryWetMixer.mixWetSamples(audioBlock);
+
+    for (int channel=0; channel<numChannels; ++channel)
+    {
+        float* held = heldValues.data() + channel * chunkSize;
+        for (int k=0; k<numTicks; ++k)
+            held[k] = juce::jlimit(-1.0f, 1.0f, held[k]);
+    }
+    return evaluations;
 }
 
 //==============================================================================
@@ -271,8 +885,26 @@ void RibCrusherAudioProcessor::getStateInformation (juce::MemoryBlock& destData)
     // You could do that either as raw data, or use the XML or ValueTree classes
     // as intermediaries to make it easy to save and load complex data.
 
+    CompiledExpr::Ptr expr;
+    {
+        const juce::ScopedLock sl (publishLock);
+        expr = published;
+    }
+
     juce::MemoryOutputStream stream(destData, false);
-    apvts.state.writeToStream(stream);
+    stream.writeInt(stateMagic);
+    stream.writeInt(stateVersion);
+
+    juce::MemoryOutputStream tree;
+    apvts.state.writeToStream(tree);
+    stream.writeInt(int(tree.getDataSize()));
+    stream.write(tree.getData(), tree.getDataSize());
+
+    stream.writeString(latestExpr);
+    writeProgram(stream, expr->program);
+
+    const juce::SpinLock::ScopedLockType sl (exprStateLock);
+    writeExprStates(stream, sharedExprStates, maxChannels);
 }
 
 void RibCrusherAudioProcessor::setStateInformation (const void* data, int sizeInBytes)
@@ -280,9 +912,59 @@ void RibCrusherAudioProcessor::setStateInformation (const void* data, int sizeIn
     // You should use this method to restore your parameters from this memory block,
     // whose contents will have been created by the getStateInformation() call.
 
-    auto tree = juce::ValueTree::readFromData(data, size_t(sizeInBytes));
+    juce::MemoryInputStream stream(data, size_t(sizeInBytes), false);
+    if (sizeInBytes < 8 || stream.readInt() != stateMagic)
+    {
+        // before version 1 the state was only the parameter tree
+        auto tree = juce::ValueTree::readFromData(data, size_t(sizeInBytes));
+        if (tree.isValid())
+        {
+            // Sessions from before shared t ran the channels one after the other. Keep
+            // them sounding the way they were saved, new instances still default to on.
+            const bool hasSharedT = tree.getChildWithProperty("id", "SHAREDT").isValid();
+            apvts.replaceState(tree);
+            if (! hasSharedT)
+                if (auto* sharedT = apvts.getParameter("SHAREDT"))
+                    sharedT->setValueNotifyingHost(0.0f);
+            restoreExpression(tree.getProperty("expression", "x").toString(), nullptr);
+        }
+        return;
+    }
+
+    // later versions only append, so anything past what this one knows is ignored
+    const int version = stream.readInt();
+    if (version < 1)
+        return;
+
+    const int treeSize = stream.readInt();
+    if (treeSize < 0 || treeSize > stream.getNumBytesRemaining())
+        return;
+    auto tree = juce::ValueTree::readFromData(static_cast<const char*>(data) + stream.getPosition(), size_t(treeSize));
+    stream.skipNextBytes(treeSize);
     if (tree.isValid())
         apvts.replaceState(tree);
+
+    // compiled here rather than when the editor opens, so the first block already runs it
+    const auto text = stream.readString();
+    Program program;
+    const bool programRead = readProgram(stream, program);
+    restoreExpression(text, programRead ? &program : nullptr);
+
+    // the cells follow the program, so they can only be found if it was read. Without
+    // them the formula starts from 0, like it would after loading any older state.
+    ExprState states[maxChannels];
+    if (version >= 2 && programRead)
+        readExprStates(stream, states, maxChannels);
+
+    int serial = 0;
+    {
+        const juce::ScopedLock sl (publishLock);
+        serial = latestSerial;
+    }
+    const juce::SpinLock::ScopedLockType sl (exprStateLock);
+    std::copy(states, states + maxChannels, sharedExprStates);
+    exprStatesRestored = true;
+    exprStatesSerial = serial;
 }
 
 //==============================================================================
@@ -302,5 +984,9 @@ juce::AudioProcessorValueTreeState::ParameterLayout RibCrusherAudioProcessor::cr
     params.push_back(make_unique<juce::AudioParameterInt>("BITSHIFT", "Bitshift", 0, 64, 0));
     params.push_back(make_unique<juce::AudioParameterFloat>("MIX", "Mix", 0.0f, 1.0f, 0.2f));
     params.push_back(make_unique<juce::AudioParameterBool>("BYTEWRAP", "8-bit wrap", true));
+    params.push_back(make_unique<juce::AudioParameterChoice>("OVERSAMPLING", "Oversampling", juce::StringArray { "Off", "2x", "4x", "8x" }, 0));
+    params.push_back(make_unique<juce::AudioParameterChoice>("OSFILTER", "Oversampling filter", juce::StringArray { "IIR", "FIR" }, 0));
+    params.push_back(make_unique<juce::AudioParameterBool>("SHAREDT", "Shared t", true));
+    params.push_back(make_unique<juce::AudioParameterChoice>("MIDIMODE", "MIDI notes", juce::StringArray { "Off", "Mono", "Poly" }, 0));
     return { params.begin(), params.end() };
     }
\ No newline at end of file
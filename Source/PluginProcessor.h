@@ -8,15 +8,25 @@
 
 #pragma once
 
-#include "../JuceLibraryCode/JuceHeader.h"
-#include "ExprParser.h"
+#include <JuceHeader.h>
+#include "ExprCompiler.h"
+#include "ExprHandoff.h"
+#include "ExprCache.h"
+#include "CrusherKernel.h"
+#include "DitherNoise.h"
+#include "Instrumentation.h"
+#include "ScopeFeed.h"
+#include "VoicePool.h"
 
 //==============================================================================
 /**
 */
 
 
-class RibCrusherAudioProcessor  : public juce::AudioProcessor
+class RibCrusherAudioProcessor  : public juce::AudioProcessor,
+                                  private juce::TimeSliceClient,
+                                  private juce::AudioProcessorValueTreeState::Listener,
+                                  private juce::AsyncUpdater
 {
 
 
@@ -59,24 +69,148 @@ public:
     void setStateInformation (const void* data, int sizeInBytes) override;
 
     juce::AudioProcessorValueTreeState apvts;
-    juce::Random random;
+    uint64_t ditherSeed = 1;    // picked up by prepareToPlay
 
-    juce::dsp::DryWetMixer<float> dryWetMixer;
+    // room for the oversampling filters' latency on the dry path
+    juce::dsp::DryWetMixer<float> dryWetMixer { 512 };
 
     juce::String latestExpr = "x";
-    std::vector<Token> parsedExpr;
+    ParseResult  latestExprResult;      // why latestExpr didn't compile, if it didn't
     uint32_t           tCount = 0;       // running index for bytebeat synthesis
 
-    std::vector<uint32_t> stack;
+    // Builds native code for a compiled expression and hands it to the audio thread,
+    // which switches to it (and restarts t) at the next block. Never call from processBlock.
+    void setProgram (const Program& newProgram);
+    // Same for a formula, compiled through the cache shared by all instances. If it
+    // doesn't parse the current expression keeps playing and null is returned.
+    CompiledExpr::Ptr setExpression (const juce::String& text, ParseResult& result);
+
+    // How many times a second processBlock would run expr with the current rate,
+    // oversampling, t and channel settings. 0 if it would play from a byte table.
+    double getEvaluationsPerSecond (const CompiledExpr& expr) const;
+    std::atomic<bool> jitEnabled { true };
+    // quantize the expression's output on ints (crushValues) instead of going through
+    // float first, off for comparing against the float path
+    std::atomic<bool> integerPipeline { true };
+
+    // per-block CPU use, read by the editor's overlay
+    BlockInstrumentation instrumentation;
+    // wet signal for the editor's scope
+    ScopeFeed scopeFeed;
 
 private:
     juce::AudioProcessorValueTreeState::ParameterLayout createParameterLayout();
-    // functions as a counter for tracking repeating sample in downsampling
-    std::vector<int> sampleCount;
-    // stores the repeating sample in downsampling
-    std::vector<float> currentSamples;
+
+    // parameter values, looked up once instead of by name every block
+    struct ParameterPointers
+    {
+        std::atomic<float>* bitDepth   = nullptr;
+        std::atomic<float>* samplerate = nullptr;
+        std::atomic<float>* bitShift   = nullptr;
+        std::atomic<float>* dither     = nullptr;
+        std::atomic<float>* byteWrap   = nullptr;
+        std::atomic<float>* mix        = nullptr;
+        std::atomic<float>* oversampling       = nullptr;  // 0 = off, 1..3 = 2x, 4x, 8x
+        std::atomic<float>* oversamplingFilter = nullptr;  // 0 = polyphase IIR, 1 = FIR
+        std::atomic<float>* sharedT            = nullptr;  // one t for all channels, or one after the other
+        std::atomic<float>* midiMode           = nullptr;  // 0 = off, 1 = mono, 2 = poly
+    };
+    ParameterPointers params;
+
+    juce::SmoothedValue<float, juce::ValueSmoothingTypes::Multiplicative> smoothedSamplerate { 44100.0f };
+    // longest sub-block processBlock runs with one rate while it glides
+    static constexpr int maxSegmentLength = 32;
+    // downsampling: samples left in the current hold, a new one starts when it runs out
+    double holdCountdown = 0.0;
+
+    // per-channel state, kept together as struct-of-arrays (the plugin is mono or stereo)
+    static constexpr int maxChannels = 2;
+    struct ChannelStates
+    {
+        float       heldSample[maxChannels] {};     // the repeating sample in downsampling
+        DitherNoise dither[maxChannels];            // one stream per channel
+        ExprState   expr[maxChannels];              // y1 and m[], a cache line each
+    };
+    ChannelStates channelStates;
+
+    // The formula state as the message thread sees it: a copy of channelStates.expr
+    // the audio thread refreshes every block, or one loaded with setStateInformation()
+    // that it takes over once it runs the expression it was saved with. The audio
+    // thread only ever tries the lock.
+    juce::SpinLock exprStateLock;
+    ExprState sharedExprStates[maxChannels];
+    bool exprStatesRestored = false;    // waiting for the expression with exprStatesSerial
+    int  exprStatesSerial = 0;
+    void exchangeExprStates();
+
+    // per-chunk scratch, one entry per hold (and channel)
+    std::vector<int> tickPositions;
+    std::vector<int> exprInput;
+    std::vector<int> exprOutput;
+    std::vector<float> heldValues;      // one run of chunk size per channel
+    std::vector<float> ditherNoise;
+    std::vector<int32_t> ditherNoiseFixed;  // the integer path's
+
+    // MIDI mode: the notes being played, and per-lane scratch for evaluating all of
+    // them together, voiceBatchTicks ticks at a time
+    static constexpr int voiceBatchTicks = 64;
+    VoicePool voices;
+    int activeMidiMode = 0;             // audio thread: voices are cleared when it changes
+    std::vector<uint32_t> voiceT;
+    std::vector<int> voiceInput;
+    std::vector<int> voiceOutput;
     double hostSamplerate = 0.0;
 
+    // [filter][factor]: every combination is built in prepareToPlay, so switching
+    // modes on the audio thread never allocates
+    static constexpr int maxOversamplingLog2 = 3;
+    std::unique_ptr<juce::dsp::Oversampling<float>> oversamplers[2][maxOversamplingLog2];
+    juce::dsp::Oversampling<float>* activeOversampler = nullptr;
+    float oversamplerLatency[2][maxOversamplingLog2] {};   // copied in prepareToPlay, for the message thread
+
+    // The audio thread only switches oversamplers. The latency is reported to the host
+    // from the message thread, because setLatencySamples() can call into the host.
+    int latencyForCurrentMode() const;
+    void parameterChanged (const juce::String& parameterID, float newValue) override;
+    void handleAsyncUpdate() override;
+
+    static double holdPeriodFor (double processRate, float targetRate);
+    static int voiceLimitFor (int midiMode) { return midiMode == 0 ? 0 : (midiMode == 1 ? 1 : VoicePool::maxVoices); }
+    // decoded straight from the raw bytes: building a juce::MidiMessage can allocate (sysex)
+    void handleMidiEvent (const juce::MidiMessageMetadata& event, int voiceLimit);
+    // expression, dither and quantizer for one block at the start of each hold,
+    // returns how many times the expression was run. With voices the held notes
+    // are summed instead of running the formula on t.
+    int crushHolds (juce::dsp::AudioBlock<float> block, double holdPeriod, const CrushCoefficients& crush,
+                    const CompiledExpr& expr, ExprJit::Function jit, bool sharedT, bool useVoices);
+    // every voice's formula for numTicks ticks of the current chunk, mixed into heldValues
+    int evaluateVoices (const juce::dsp::AudioBlock<float>& block, int start, int numTicks, int numChannels,
+                        const CompiledExpr& expr, ExprJit::Function jit, bool wrap);
+
+    juce::SharedResourcePointer<ExprCache> exprCache;
+    ExprHandoff exprHandoff;
+    void publish (CompiledExpr::Ptr expr);
+    // compiles a formula from saved state (or the default one). The program that was
+    // playing when it was saved is only played (unshared) if the text doesn't parse.
+    void restoreExpression (const juce::String& text, const Program* stored);
+
+    // state format: magic, version, parameter tree, expression text, compiled program,
+    // formula state (version 2)
+    static constexpr int stateMagic   = 0x53434252;   // "RBCS" little endian
+    static constexpr int stateVersion = 2;
+    // releases retired expressions (and other housekeeping) off the audio thread
+    juce::TimeSliceThread backgroundThread { "RibCrusher background" };
+
+    // guards publishing, so a late table render can't replace a newer expression
+    juce::CriticalSection publishLock;
+    int latestSerial = 0;               // of the last expression published
+    CompiledExpr::Ptr pendingTable;     // waiting for its byte table to be rendered
+    CompiledExpr::Ptr published;        // the last one published, saved with the state
+    int activeSerial = -1;              // audio thread: expression t is counting for
+
+    // renders byte tables on the background thread
+    int useTimeSlice() override;
+
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (RibCrusherAudioProcessor)
 };
@@ -0,0 +1,129 @@
+#include "ScopeComponent.h"
+
+ScopeComponent::ScopeComponent (ScopeFeed& feedToShow)
+    : feed(feedToShow)
+{
+    // nothing behind it needs repainting when it updates
+    setOpaque(true);
+}
+
+ScopeComponent::~ScopeComponent()
+{
+    feed.setActive(false);
+}
+
+void ScopeComponent::visibilityChanged()       { updateFeedActive(); }
+void ScopeComponent::parentHierarchyChanged()  { updateFeedActive(); }
+
+// The feed runs while the scope is showing. Only switched on a change, because
+// setActive() drains the FIFO and the vblank pops right after it.
+void ScopeComponent::updateFeedActive()
+{
+    const bool showing = isShowing();
+    if (showing == feedActive)
+        return;
+
+    feedActive = showing;
+    feed.setActive(showing);
+}
+
+// vblank callback, only called while the component is on screen
+void ScopeComponent::update()
+{
+    const int count = feed.pop(incoming.data(), int(incoming.size()));
+    for (int i=0; i<count; ++i)
+    {
+        history[size_t(historyPos)] = incoming[size_t(i)];
+        historyPos = (historyPos + 1) & (fftSize - 1);
+    }
+
+    // samples keep going into the history in between, they just aren't drawn yet
+    const double now = juce::Time::getMillisecondCounterHiRes();
+    if (count == 0 || now - lastFrameMs < 1000.0 / maxFramesPerSecond)
+        return;
+    lastFrameMs = now;
+
+    for (int i=0; i<fftSize; ++i)
+        linear[size_t(i)] = history[size_t((historyPos + i) & (fftSize - 1))];
+
+    const auto bounds = getLocalBounds().toFloat().reduced(2.0f);
+    buildWaveform(bounds.withWidth(bounds.getWidth() * 0.5f - 2.0f));
+    buildSpectrum(bounds.withLeft(bounds.getCentreX() + 2.0f));
+    repaint();
+}
+
+void ScopeComponent::buildWaveform (juce::Rectangle<float> area)
+{
+    // start on a rising zero crossing, as late as possible, so periodic formulas stand still
+    int start = fftSize - waveformLength;
+    for (int s=start; s>start-waveformLength && s>0; --s)
+    {
+        if (linear[size_t(s - 1)] < 0.0f && linear[size_t(s)] >= 0.0f)
+        {
+            start = s;
+            break;
+        }
+    }
+
+    waveformPath.clear();
+    for (int i=0; i<waveformLength; ++i)
+    {
+        const float x = area.getX() + area.getWidth() * float(i) / float(waveformLength - 1);
+        const float y = juce::jmap(juce::jlimit(-1.0f, 1.0f, linear[size_t(start + i)]), -1.0f, 1.0f, area.getBottom(), area.getY());
+        if (i == 0)
+            waveformPath.startNewSubPath(x, y);
+        else
+            waveformPath.lineTo(x, y);
+    }
+}
+
+void ScopeComponent::buildSpectrum (juce::Rectangle<float> area)
+{
+    std::copy(linear.begin(), linear.end(), fftData.begin());
+    std::fill(fftData.begin() + fftSize, fftData.end(), 0.0f);
+    window.multiplyWithWindowingTable(fftData.data(), size_t(fftSize));
+    fft.performFrequencyOnlyForwardTransform(fftData.data());
+
+    // log frequency axis from 20 Hz to Nyquist, -90..0 dB (a full scale sine reads 0 dB)
+    const double nyquist = feed.getSampleRate() * 0.5;
+    const double binsPerHz = fftSize / feed.getSampleRate();
+    const int width = juce::jmax(1, int(area.getWidth()));
+    const float scale = 4.0f / float(fftSize);
+
+    spectrumPath.clear();
+    for (int px=0; px<width; ++px)
+    {
+        const double f0 = 20.0 * std::pow(nyquist / 20.0, double(px) / width);
+        const double f1 = 20.0 * std::pow(nyquist / 20.0, double(px + 1) / width);
+        const int first = juce::jlimit(1, fftSize / 2 - 1, int(f0 * binsPerHz));
+        const int last  = juce::jlimit(first, fftSize / 2 - 1, int(f1 * binsPerHz));
+
+        // loudest bin under the pixel, so narrow peaks don't vanish at the top end
+        float magnitude = 0.0f;
+        for (int bin=first; bin<=last; ++bin)
+            magnitude = juce::jmax(magnitude, fftData[size_t(bin)]);
+
+        const float db = juce::jlimit(-90.0f, 0.0f, juce::Decibels::gainToDecibels(magnitude * scale, -90.0f));
+        const float x = area.getX() + float(px);
+        const float y = juce::jmap(db, -90.0f, 0.0f, area.getBottom(), area.getY());
+        if (px == 0)
+            spectrumPath.startNewSubPath(x, y);
+        else
+            spectrumPath.lineTo(x, y);
+    }
+}
+
+void ScopeComponent::paint (juce::Graphics& g)
+{
+    g.fillAll(juce::Colours::black);
+
+    const auto bounds = getLocalBounds().toFloat();
+    g.setColour(juce::Colours::darkgrey);
+    g.drawRect(bounds, 1.0f);
+    g.drawVerticalLine(int(bounds.getCentreX()), bounds.getY(), bounds.getBottom());
+    g.drawHorizontalLine(int(bounds.getCentreY()), bounds.getX(), bounds.getCentreX());
+
+    g.setColour(juce::Colours::orange);
+    g.strokePath(waveformPath, juce::PathStrokeType(1.0f));
+    g.strokePath(spectrumPath, juce::PathStrokeType(1.0f));
+}
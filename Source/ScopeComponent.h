@@ -0,0 +1,52 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "ScopeFeed.h"
+#include <array>
+
+// Waveform (left) and spectrum (right) of the wet signal. Updates from the
+// display's vblank, at most maxFramesPerSecond times a second and only when
+// new samples came in, and then repaints just itself. Paths are built in the
+// update so paint() only strokes them.
+class ScopeComponent  : public juce::Component
+{
+public:
+    explicit ScopeComponent (ScopeFeed& feedToShow);
+    ~ScopeComponent() override;
+
+    void paint (juce::Graphics&) override;
+    void visibilityChanged() override;
+    void parentHierarchyChanged() override;
+
+private:
+    static constexpr int    fftOrder = 11;
+    static constexpr int    fftSize = 1 << fftOrder;
+    static constexpr int    waveformLength = 512;       // decimated samples across the waveform view
+    static constexpr double maxFramesPerSecond = 30.0;
+
+    void update();
+    void updateFeedActive();
+    void buildWaveform (juce::Rectangle<float> area);
+    void buildSpectrum (juce::Rectangle<float> area);
+
+    ScopeFeed& feed;
+
+    // most recent samples, oldest first once linearized
+    std::array<float, fftSize> history {};
+    int historyPos = 0;
+
+    std::array<float, ScopeFeed::capacity> incoming {};
+    std::array<float, fftSize> linear {};
+    std::array<float, fftSize * 2> fftData {};
+
+    juce::dsp::FFT fft { fftOrder };
+    juce::dsp::WindowingFunction<float> window { size_t(fftSize), juce::dsp::WindowingFunction<float>::hann, false };
+
+    juce::Path waveformPath, spectrumPath;
+    double lastFrameMs = 0.0;
+    bool   feedActive = false;     // message thread only
+
+    juce::VBlankAttachment vblank { this, [this] { update(); } };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ScopeComponent)
+};
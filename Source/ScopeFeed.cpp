@@ -0,0 +1,62 @@
+#include "ScopeFeed.h"
+
+void ScopeFeed::prepare (double sampleRate)
+{
+    decimation = juce::jmax(1, int(std::ceil(sampleRate / 48000.0 - 1.0e-6)));
+    accumulated = 0;
+    accumulator = 0.0f;
+    outputRate.store(sampleRate / decimation, std::memory_order_relaxed);
+}
+
+void ScopeFeed::push (const juce::dsp::AudioBlock<float>& block) noexcept
+{
+    if (! active.load(std::memory_order_relaxed))
+        return;
+
+    const int numChannels = int(block.getNumChannels());
+    const int numSamples = int(block.getNumSamples());
+    if (numChannels == 0)
+        return;
+
+    // write() only hands out what's free, the rest of this block is dropped
+    const auto scope = fifo.write((accumulated + numSamples) / decimation);
+    const int room = scope.blockSize1 + scope.blockSize2;
+    const float gain = 1.0f / float(numChannels * decimation);
+
+    int written = 0;
+    for (int i=0; i<numSamples; ++i)
+    {
+        for (int ch=0; ch<numChannels; ++ch)
+            accumulator += block.getSample(ch, i);
+
+        if (++accumulated == decimation)
+        {
+            if (written < room)
+            {
+                const int index = written < scope.blockSize1 ? scope.startIndex1 + written
+                                                             : scope.startIndex2 + written - scope.blockSize1;
+                ring[size_t(index)] = accumulator * gain;
+            }
+            ++written;
+            accumulated = 0;
+            accumulator = 0.0f;
+        }
+    }
+}
+
+int ScopeFeed::pop (float* dest, int maxCount)
+{
+    const auto scope = fifo.read(juce::jmin(maxCount, fifo.getNumReady()));
+    int count = 0;
+    scope.forEach([&] (int index) { dest[count++] = ring[size_t(index)]; });
+    return count;
+}
+
+void ScopeFeed::setActive (bool shouldBeActive)
+{
+    active.store(shouldBeActive, std::memory_order_relaxed);
+
+    // stale samples from the last time it was on would show up as a jump
+    const auto scope = fifo.read(fifo.getNumReady());
+    juce::ignoreUnused(scope);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <array>
+#include <atomic>
+
+// The wet signal on its way from processBlock to the editor's scope: mixed down
+// to mono, decimated and queued in a single producer, single consumer FIFO.
+// The audio thread never waits or allocates here; when the reader falls behind
+// the newest samples are dropped. Nothing at all is done until a reader asks.
+class ScopeFeed
+{
+public:
+    static constexpr int capacity = 8192;       // decimated samples, ~0.2 s at 44.1 kHz
+
+    // Before processing starts: picks a decimation that keeps the stream at 48 kHz or below
+    void prepare (double sampleRate);
+
+    // Audio thread
+    void push (const juce::dsp::AudioBlock<float>& block) noexcept;
+
+    // Reader (one thread, the scope's vblank callback): moves up to maxCount samples
+    // into dest, oldest first
+    int pop (float* dest, int maxCount);
+    // The reader switches the feed on while it's on screen, and drains what's left on the way
+    void setActive (bool shouldBeActive);
+    double getSampleRate() const        { return outputRate.load(std::memory_order_relaxed); }
+
+private:
+    juce::AbstractFifo fifo { capacity };
+    std::array<float, capacity> ring {};
+
+    std::atomic<bool>   active { false };
+    std::atomic<double> outputRate { 44100.0 };
+
+    // audio thread only
+    int   decimation = 1;
+    int   accumulated = 0;
+    float accumulator = 0.0f;   // sum of the samples of the current output, a box filter against aliasing
+};
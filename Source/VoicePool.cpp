@@ -0,0 +1,90 @@
+#include "VoicePool.h"
+#include <cmath>
+
+VoicePool::VoicePool()
+{
+    for (int n=0; n<128; ++n)
+        noteIncrement[n] = uint64_t(std::llround(std::exp2((n - 60) / 12.0) * 4294967296.0));
+}
+
+void VoicePool::noteOn (int newNote, float velocity, int voiceLimit)
+{
+    if (newNote < 0 || newNote > 127 || voiceLimit <= 0)
+        return;
+
+    // the same note again restarts its voice, otherwise a free one, otherwise the oldest
+    int voice = 0;
+    while (voice < numActive && note[voice] != newNote)
+        ++voice;
+
+    if (voice == numActive)
+    {
+        if (numActive < voiceLimit && numActive < maxVoices)
+        {
+            ++numActive;
+        }
+        else
+        {
+            voice = 0;
+            for (int v=1; v<numActive; ++v)
+                if (startedAt[v] - startedAt[voice] > 0x80000000u)
+                    voice = v;
+        }
+    }
+
+    phase[voice]     = 0;
+    increment[voice] = noteIncrement[newNote];
+    gain[voice]      = velocity;
+    note[voice]      = newNote;
+    startedAt[voice] = numStarted++;
+    for (auto& s : state[voice])
+        s = ExprState();
+}
+
+void VoicePool::noteOff (int oldNote)
+{
+    for (int v=0; v<numActive; ++v)
+    {
+        if (note[v] == oldNote)
+        {
+            remove(v);
+            return;
+        }
+    }
+}
+
+void VoicePool::reset()
+{
+    numActive = 0;
+}
+
+void VoicePool::remove (int voice) noexcept
+{
+    // the last voice takes its slot, so the active ones stay packed
+    const int last = --numActive;
+    phase[voice]     = phase[last];
+    increment[voice] = increment[last];
+    gain[voice]      = gain[last];
+    note[voice]      = note[last];
+    startedAt[voice] = startedAt[last];
+    for (int lane=0; lane<maxLanes; ++lane)
+        state[voice][lane] = state[last][lane];
+}
+
+void VoicePool::advance (uint32_t* t, int numTicks, int lanesPerVoice) noexcept
+{
+    const int tickStride = numActive * lanesPerVoice;
+    for (int v=0; v<numActive; ++v)
+    {
+        uint64_t p = phase[v];
+        const uint64_t step = increment[v];
+        uint32_t* dest = t + v * lanesPerVoice;
+        for (int k=0; k<numTicks; ++k)
+        {
+            p += step;
+            for (int lane=0; lane<lanesPerVoice; ++lane)
+                dest[k * tickStride + lane] = uint32_t(p >> 32);
+        }
+        phase[v] = p;
+    }
+}
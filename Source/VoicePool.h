@@ -0,0 +1,51 @@
+#pragma once
+
+#include "ExprCompiler.h"
+#include <cstdint>
+
+// MIDI voices for the bytebeat: every held note runs the formula with its own t,
+// advancing 2^((note - 60) / 12) per tick, so middle C plays at the formula's own
+// speed and each octave doubles it. A new note starts its t over.
+//
+// Formulas that use y1 or m[] get an ExprState per voice and lane, which also starts
+// over with the note.
+//
+// Fixed capacity, struct-of-arrays, the sounding voices packed at the front: the
+// audio thread never allocates and walks one contiguous run per property.
+class VoicePool
+{
+public:
+    static constexpr int maxVoices = 16;
+    static constexpr int maxLanes  = 2;     // channels a voice runs the formula for
+
+    VoicePool();
+
+    // voiceLimit 1 is a mono synth: every note takes over the one voice
+    void noteOn (int note, float velocity, int voiceLimit);
+    void noteOff (int note);
+    void reset();
+
+    int getNumActive() const noexcept { return numActive; }
+    float getGain (int voice) const noexcept { return gain[voice]; }
+    ExprState* getState (int voice, int lane) noexcept { return &state[voice][lane]; }
+
+    // Steps every voice numTicks ticks and writes the t of each step to
+    // t[(tick * numActive + voice) * lanesPerVoice + lane] for every lane,
+    // the layout the batch evaluation runs over
+    void advance (uint32_t* t, int numTicks, int lanesPerVoice) noexcept;
+
+private:
+    void remove (int voice) noexcept;
+
+    // t in 32.32 fixed point, so slow notes still move by a fraction of a step per tick
+    alignas(64) uint64_t phase[maxVoices] {};
+    alignas(64) uint64_t increment[maxVoices] {};
+    float    gain[maxVoices] {};
+    int      note[maxVoices] {};
+    uint32_t startedAt[maxVoices] {};   // for stealing the oldest voice
+    ExprState state[maxVoices][maxLanes];
+    int      numActive = 0;
+    uint32_t numStarted = 0;
+
+    uint64_t noteIncrement[128];
+};